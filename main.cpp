@@ -21,6 +21,31 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 //***************************************************************************************************//
@@ -233,463 +258,4185 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 //                                DO NOT MODIFY THE SECTION ABOVE                                    //
 //***************************************************************************************************//
 
+//***************************************************************************************************//
+//                                EXTENDED BMP READ / WRITE                                          //
+//***************************************************************************************************//
+
+// BMP compression methods we understand
+const int BMP_BI_RGB = 0;
+const int BMP_BI_RLE8 = 1;
+const int BMP_BI_RLE4 = 2;
+const int BMP_BI_BITFIELDS = 3;
+
+// 32 bit BGRA pixels are unpacked straight into the three ints of a Pixel
+static_assert(sizeof(Pixel) == 3 * sizeof(int), "Pixel must be three packed ints");
+
+/**
+ * Gets an unsigned little endian integer from a byte buffer.
+ * Helper function for read_bmp()
+ * @param data   the buffer
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read
+ * @return the integer starting at the given offset
+ */
+unsigned int get_uint(const vector<unsigned char>& data, int offset, int bytes) {
+    unsigned int result = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        result = (result << 8) | data[offset + i];
+    }
+    return result;
+}
+
+/**
+ * Packs a pixel into a single 0xRRGGBB key, truncating each channel to a byte
+ * the same way write_image() does
+ * @param pixel The pixel to pack
+ * @return the packed color
+ */
+int pack_color(const Pixel& pixel) {
+    return ((pixel.red & 255) << 16) | ((pixel.green & 255) << 8) | (pixel.blue & 255);
+}
+
+/**
+ * Sets a palette index inside a packed 1, 4 or 8 bit scanline
+ * @param row            The scanline bytes
+ * @param col            The pixel column
+ * @param bits_per_pixel Bits per palette index (1, 4 or 8)
+ * @param index          The palette index to store
+ * @return nothing
+ */
+void set_packed_index(unsigned char row[], int col, int bits_per_pixel, int index) {
+    int pixels_per_byte = 8 / bits_per_pixel;
+    int shift = 8 - bits_per_pixel * (col % pixels_per_byte + 1);
+    row[col / pixels_per_byte] |= (unsigned char)(index << shift);
+}
+
+/**
+ * Gets a palette index out of a packed 1, 4 or 8 bit scanline
+ * @param row            The scanline bytes
+ * @param col            The pixel column
+ * @param bits_per_pixel Bits per palette index (1, 4 or 8)
+ * @return the palette index stored at that column
+ */
+int get_packed_index(const unsigned char row[], int col, int bits_per_pixel) {
+    int pixels_per_byte = 8 / bits_per_pixel;
+    int shift = 8 - bits_per_pixel * (col % pixels_per_byte + 1);
+    return (row[col / pixels_per_byte] >> shift) & ((1 << bits_per_pixel) - 1);
+}
+
+/**
+ * Decodes BI_RLE8 or BI_RLE4 pixel data into a grid of palette indexes
+ * Helper function for read_bmp()
+ * @param data           The whole BMP file
+ * @param start          Offset of the pixel data
+ * @param width          Image width in pixels
+ * @param height         Image height in pixels
+ * @param bits_per_pixel 8 for RLE8, 4 for RLE4
+ * @param indexes        Output, height rows of width indexes (bottom row first)
+ * @return True if the stream decoded cleanly and false otherwise
+ */
+bool decode_rle(const vector<unsigned char>& data, int start, int width, int height,
+                int bits_per_pixel, vector<vector<unsigned char>>& indexes) {
+    indexes.assign(height, vector<unsigned char> (width, 0));
+    int pos = start;
+    int size = data.size();
+    int x = 0;
+    int y = 0;
+
+    while (pos + 1 < size)
+    {
+        int count = data[pos];
+        int value = data[pos + 1];
+        pos = pos + 2;
+
+        if (count > 0)
+        {
+            // Encoded mode: count pixels of one index (RLE4 alternates two nibbles)
+            for (int i = 0; i < count; i++)
+            {
+                int index = value;
+                if (bits_per_pixel == 4)
+                {
+                    index = (i % 2 == 0) ? (value >> 4) : (value & 15);
+                }
+                if (y < height && x < width)
+                {
+                    indexes[y][x] = index;
+                }
+                x++;
+            }
+        }
+        else if (value == 0)
+        {
+            // End of line
+            x = 0;
+            y++;
+        }
+        else if (value == 1)
+        {
+            // End of bitmap
+            return true;
+        }
+        else if (value == 2)
+        {
+            // Delta: skip right and up, skipped pixels keep index 0
+            if (pos + 1 >= size)
+            {
+                return false;
+            }
+            x = x + data[pos];
+            y = y + data[pos + 1];
+            pos = pos + 2;
+        }
+        else
+        {
+            // Absolute mode: value literal indexes, padded to a 16 bit boundary
+            int literal_bytes = (bits_per_pixel == 8) ? value : (value + 1) / 2;
+            if (pos + literal_bytes > size)
+            {
+                return false;
+            }
+            for (int i = 0; i < value; i++)
+            {
+                int index = 0;
+                if (bits_per_pixel == 8)
+                {
+                    index = data[pos + i];
+                }
+                else
+                {
+                    index = (i % 2 == 0) ? (data[pos + i / 2] >> 4) : (data[pos + i / 2] & 15);
+                }
+                if (y < height && x < width)
+                {
+                    indexes[y][x] = index;
+                }
+                x++;
+            }
+            pos = pos + literal_bytes + literal_bytes % 2;
+        }
+    }
+
+    // Some encoders leave off the end of bitmap marker
+    return y >= height - 1;
+}
+
+// Properties from the BMP and DIB headers
+struct BmpInfo
+{
+    long long start;    // Offset of the pixel array
+    int width;          // Width in pixels
+    int height;         // Height in pixels
+    int bits_per_pixel; // 1, 4, 8, 24 or 32
+    int compression;    // BMP_BI_RGB, BMP_BI_RLE8, BMP_BI_RLE4 or BMP_BI_BITFIELDS
+    long long row_bytes; // Bytes per scanline including padding
+    long long file_size;
+    bool top_down;      // Scanline 0 is the top row (negative height in the header)
+};
+
+/**
+ * Gets the image row a file scanline holds, or the scanline an image row is stored in
+ * @param info     The image properties
+ * @param scanline The scanline (or image row)
+ * @return the image row (or scanline)
+ */
+int scanline_row(const BmpInfo& info, int scanline) {
+    return info.top_down ? scanline : info.height - 1 - scanline;
+}
+
+/**
+ * Gets the size of a scanline, which is padded to a multiple of four bytes
+ * @param width          Width in pixels
+ * @param bits_per_pixel Bits per pixel
+ * @return the scanline size in bytes
+ */
+long long scanline_bytes(long long width, int bits_per_pixel) {
+    return ((width * bits_per_pixel + 31) / 32) * 4;
+}
+
+// Rows smaller than this in total are not worth handing to extra threads
+const long long MIN_BAND_BYTES = 1 << 20;
+
+// Largest buffer a single pread/pwrite call of a band works with
+const long long MAX_CHUNK_BYTES = 8 << 20;
+
+// Most threads parallel_rows() starts, 0 for one per hardware thread
+unsigned int max_threads = 0;
+
+/**
+ * Gets the number of threads parallel_rows() may start
+ * @return max_threads if set, otherwise the number of hardware threads (at least 1)
+ */
+long long thread_count() {
+    if (max_threads > 0)
+    {
+        return max_threads;
+    }
+    return max(1u, thread::hardware_concurrency());
+}
+
+/**
+ * Reads exactly the requested bytes at an offset, retrying short reads
+ * @param fd     The file descriptor
+ * @param buffer Where to store the bytes
+ * @param bytes  Number of bytes to read
+ * @param offset File offset to read from
+ * @return True if every byte was read and false otherwise
+ */
+bool pread_all(int fd, unsigned char* buffer, long long bytes, long long offset) {
+    while (bytes > 0)
+    {
+        ssize_t count = pread(fd, buffer, bytes, offset);
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer = buffer + count;
+        bytes = bytes - count;
+        offset = offset + count;
+    }
+    return true;
+}
+
+/**
+ * Writes exactly the requested bytes at an offset, retrying short writes
+ * @param fd     The file descriptor
+ * @param buffer The bytes to write
+ * @param bytes  Number of bytes to write
+ * @param offset File offset to write to
+ * @return True if every byte was written and false otherwise
+ */
+bool pwrite_all(int fd, const unsigned char* buffer, long long bytes, long long offset) {
+    while (bytes > 0)
+    {
+        ssize_t count = pwrite(fd, buffer, bytes, offset);
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer = buffer + count;
+        bytes = bytes - count;
+        offset = offset + count;
+    }
+    return true;
+}
+
+/**
+ * Splits rows [0, rows) into one contiguous band per hardware thread and runs
+ * work on every band at the same time. Small jobs stay on the calling thread.
+ * @param rows      Number of rows
+ * @param row_bytes Bytes per row, used to decide how many threads are worth it
+ * @param work      Called as work(first_row, last_row), returns false on failure
+ * @return True if every band succeeded and false otherwise
+ */
+bool parallel_rows(int rows, long long row_bytes, const function<bool(int, int)>& work) {
+    long long threads = thread_count();
+    threads = min(threads, row_bytes * rows / MIN_BAND_BYTES);
+    threads = min(threads, (long long)rows);
+    if (threads <= 1)
+    {
+        return work(0, rows);
+    }
+
+    vector<thread> workers;
+    vector<char> results(threads, 0);
+    for (int t = 0; t < threads; t++)
+    {
+        int first = rows * t / threads;
+        int last = rows * (t + 1) / threads;
+        workers.push_back(thread([&work, &results, t, first, last]() {
+            results[t] = work(first, last);
+        }));
+    }
+
+    bool ok = true;
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t].join();
+        ok = ok && results[t];
+    }
+    return ok;
+}
+
+// Histogram channels; gray is (red + green + blue) / 3 as in the grayscale effect
+const int STATS_RED = 0;
+const int STATS_GREEN = 1;
+const int STATS_BLUE = 2;
+const int STATS_GRAY = 3;
+
+// Histograms and totals of an image
+struct ImageStats
+{
+    long long histogram[4][256]; // Pixel count of every value, per channel
+    long long sum[4];            // Sum of every value, per channel
+    int min[4];                  // Smallest value, per channel
+    int max[4];                  // Largest value, per channel
+    long long count;             // Number of pixels
+};
+
+/**
+ * Empties the statistics
+ * @param stats The statistics to reset
+ * @return nothing
+ */
+void clear_stats(ImageStats& stats) {
+    for (int c = 0; c < 4; c++)
+    {
+        fill(stats.histogram[c], stats.histogram[c] + 256, 0);
+        stats.sum[c] = 0;
+        stats.min[c] = 255;
+        stats.max[c] = 0;
+    }
+    stats.count = 0;
+}
+
+/**
+ * Counts a row of pixels into the histograms
+ * @param stats  The statistics to add to
+ * @param pixels The row of pixels
+ * @return nothing
+ */
+void add_row_stats(ImageStats& stats, const vector<Pixel>& pixels) {
+    for (int col = 0; col < (int)pixels.size(); col++)
+    {
+        int red_color = pixels[col].red & 255;
+        int green_color = pixels[col].green & 255;
+        int blue_color = pixels[col].blue & 255;
+
+        stats.histogram[STATS_RED][red_color]++;
+        stats.histogram[STATS_GREEN][green_color]++;
+        stats.histogram[STATS_BLUE][blue_color]++;
+        stats.histogram[STATS_GRAY][(red_color + green_color + blue_color) / 3]++;
+    }
+    stats.count = stats.count + pixels.size();
+}
+
+/**
+ * Works out the sums, minimums and maximums from the histograms, so the per pixel
+ * work while counting stays at four increments
+ * @param stats The statistics to finish
+ * @return nothing
+ */
+void finish_stats(ImageStats& stats) {
+    for (int c = 0; c < 4; c++)
+    {
+        stats.sum[c] = 0;
+        stats.min[c] = 255;
+        stats.max[c] = 0;
+        for (int value = 0; value < 256; value++)
+        {
+            if (stats.histogram[c][value] > 0)
+            {
+                stats.sum[c] = stats.sum[c] + stats.histogram[c][value] * value;
+                stats.min[c] = min(stats.min[c], value);
+                stats.max[c] = max(stats.max[c], value);
+            }
+        }
+    }
+}
+
+/**
+ * Adds one set of statistics into another. Bands are counted separately and merged at the end.
+ * @param into The statistics to add to
+ * @param from The statistics to add
+ * @return nothing
+ */
+void merge_stats(ImageStats& into, const ImageStats& from) {
+    for (int c = 0; c < 4; c++)
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            into.histogram[c][value] = into.histogram[c][value] + from.histogram[c][value];
+        }
+    }
+    into.count = into.count + from.count;
+    finish_stats(into);
+}
+
+/**
+ * Gets the average value of a channel
+ * @param stats   The statistics
+ * @param channel STATS_RED, STATS_GREEN, STATS_BLUE or STATS_GRAY
+ * @return the mean value
+ */
+double stats_mean(const ImageStats& stats, int channel) {
+    if (stats.count == 0)
+    {
+        return 0;
+    }
+    return (double)stats.sum[channel] / stats.count;
+}
+
+/**
+ * Gets the value below which the given fraction of a channel's pixels fall
+ * @param stats    The statistics
+ * @param channel  STATS_RED, STATS_GREEN, STATS_BLUE or STATS_GRAY
+ * @param fraction Between 0 and 1
+ * @return the smallest value with at least that fraction of pixels at or below it
+ */
+int stats_percentile(const ImageStats& stats, int channel, double fraction) {
+    long long target = (long long)ceil(fraction * stats.count);
+    long long seen = 0;
+    for (int value = 0; value < 256; value++)
+    {
+        seen = seen + stats.histogram[channel][value];
+        if (seen >= target && seen > 0)
+        {
+            return value;
+        }
+    }
+    return 255;
+}
+
+/**
+ * Finds the gray level that best splits the image into dark and light (Otsu's method):
+ * the threshold with the largest variance between the two groups
+ * @param stats The statistics
+ * @return the threshold, pixels above it belong to the light group
+ */
+int otsu_threshold(const ImageStats& stats) {
+    const long long* histogram = stats.histogram[STATS_GRAY];
+    double total_sum = stats.sum[STATS_GRAY];
+    double dark_sum = 0;
+    long long dark_count = 0;
+    double best_variance = -1;
+    int best_threshold = 127;
+
+    for (int t = 0; t < 255; t++)
+    {
+        dark_count = dark_count + histogram[t];
+        dark_sum = dark_sum + (double)histogram[t] * t;
+        long long light_count = stats.count - dark_count;
+        if (dark_count == 0 || light_count == 0)
+        {
+            continue;
+        }
+
+        double dark_mean = dark_sum / dark_count;
+        double light_mean = (total_sum - dark_sum) / light_count;
+        double variance = (double)dark_count * light_count * (dark_mean - light_mean) * (dark_mean - light_mean);
+        if (variance > best_variance)
+        {
+            best_variance = variance;
+            best_threshold = t;
+        }
+    }
+    return best_threshold;
+}
+
+/**
+ * Reads the BMP and DIB headers and the palette, if there is one
+ * @param fd      The open BMP file
+ * @param info    Output, the image properties
+ * @param palette Output, the palette colors (empty for 24 and 32 bit images)
+ * @return True if this is an image read_bmp() can decode and false otherwise
+ */
+bool read_bmp_info(int fd, BmpInfo& info, vector<Pixel>& palette) {
+    struct stat file_stat;
+    vector<unsigned char> header(54);
+    if (fstat(fd, &file_stat) != 0 || !pread_all(fd, header.data(), 54, 0))
+    {
+        return false;
+    }
+    if (header[0] != 'B' || header[1] != 'M')
+    {
+        return false;
+    }
+
+    // Get the image properties
+    info.file_size = file_stat.st_size;
+    info.start = get_uint(header, 10, 4);
+    int dib_size = get_uint(header, 14, 4);
+    info.width = (int)get_uint(header, 18, 4);
+    info.height = (int)get_uint(header, 22, 4);
+    info.top_down = info.height < 0;
+    if (info.top_down)
+    {
+        info.height = -info.height;
+    }
+    info.bits_per_pixel = get_uint(header, 28, 2);
+    info.compression = get_uint(header, 30, 4);
+    int colors_used = get_uint(header, 46, 4);
+
+    info.row_bytes = scanline_bytes(info.width, info.bits_per_pixel);
+
+    if (info.width <= 0 || info.height <= 0 || info.start < 54 || info.start > info.file_size)
+    {
+        return false;
+    }
+
+    // Palettized images keep a table of BGRx colors right after the DIB header
+    palette.clear();
+    int bits_per_pixel = info.bits_per_pixel;
+    if (bits_per_pixel == 1 || bits_per_pixel == 4 || bits_per_pixel == 8)
+    {
+        if (colors_used == 0 || colors_used > (1 << bits_per_pixel))
+        {
+            colors_used = 1 << bits_per_pixel;
+        }
+        header.resize(info.start);
+        if (!pread_all(fd, header.data(), info.start, 0))
+        {
+            return false;
+        }
+        palette.assign(1 << bits_per_pixel, Pixel {0, 0, 0});
+        int palette_start = 14 + dib_size;
+        for (int i = 0; i < colors_used && palette_start + i * 4 + 3 <= info.start; i++)
+        {
+            palette[i].blue = header[palette_start + i * 4];
+            palette[i].green = header[palette_start + i * 4 + 1];
+            palette[i].red = header[palette_start + i * 4 + 2];
+        }
+    }
+    else if (bits_per_pixel != 24 && bits_per_pixel != 32)
+    {
+        return false;
+    }
+
+    // Run length encoded images are always stored bottom up
+    if (info.compression == BMP_BI_RLE8 || info.compression == BMP_BI_RLE4)
+    {
+        return !info.top_down && bits_per_pixel == (info.compression == BMP_BI_RLE8 ? 8 : 4);
+    }
+
+    // 32 bit bit fields are only decoded in the usual BGRA byte order
+    if (info.compression == BMP_BI_BITFIELDS && bits_per_pixel == 32)
+    {
+        vector<unsigned char> masks(12);
+        if (!pread_all(fd, masks.data(), 12, 54) || get_uint(masks, 0, 4) != 0xFF0000 ||
+            get_uint(masks, 4, 4) != 0xFF00 || get_uint(masks, 8, 4) != 0xFF)
+        {
+            return false;
+        }
+    }
+    else if (info.compression != BMP_BI_RGB)
+    {
+        return false;
+    }
+    return info.start + info.row_bytes * info.height <= info.file_size;
+}
+
+/**
+ * Unpacks a scanline of 32 bit BGRA pixels, dropping or keeping the alpha channel
+ * Helper function for decode_rows()
+ * @param row    The scanline
+ * @param pixels Output, the row of pixels
+ * @param alpha  If not null, output, the alpha value of each pixel
+ * @return nothing
+ */
+void decode_bgra_row(const unsigned char* row, vector<Pixel>& pixels, unsigned char* alpha) {
+    int width = pixels.size();
+    int j = 0;
+#ifdef __SSE2__
+    // Widen 4 pixels at a time to ints and swap blue and red. Each 16 byte store spills the
+    // alpha into the red of the next pixel, which the next store overwrites, so the last
+    // pixel of the row is left to the scalar loop.
+    const __m128i zero = _mm_setzero_si128();
+    for (; j + 4 < width; j = j + 4)
+    {
+        __m128i bgra = _mm_loadu_si128((const __m128i*)(row + j * 4));
+        __m128i low = _mm_unpacklo_epi8(bgra, zero);
+        __m128i high = _mm_unpackhi_epi8(bgra, zero);
+        __m128i wide[4] = {_mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+                           _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero)};
+        for (int k = 0; k < 4; k++)
+        {
+            _mm_storeu_si128((__m128i*)&pixels[j + k], _mm_shuffle_epi32(wide[k], _MM_SHUFFLE(3, 0, 1, 2)));
+        }
+        if (alpha != NULL)
+        {
+            __m128i values = _mm_srli_epi32(bgra, 24);
+            values = _mm_packus_epi16(_mm_packs_epi32(values, zero), zero);
+            int packed = _mm_cvtsi128_si32(values);
+            memcpy(alpha + j, &packed, 4);
+        }
+    }
+#endif
+    for (; j < width; j++)
+    {
+        const unsigned char* pixel = row + j * 4;
+        pixels[j].blue = pixel[0];
+        pixels[j].green = pixel[1];
+        pixels[j].red = pixel[2];
+        if (alpha != NULL)
+        {
+            alpha[j] = pixel[3];
+        }
+    }
+}
+
+/**
+ * Reads file scanlines [first, last) of an uncompressed BMP and unpacks them into the image.
+ * Helper function for read_bmp(); every call owns its rows, so calls can run in parallel.
+ * @param fd      The open BMP file
+ * @param info    The image properties
+ * @param palette The palette colors for 1, 4 and 8 bit images
+ * @param image   Output, already sized to height rows of width pixels
+ * @param first   First scanline (0 is the bottom row of the image, or the top row if top down)
+ * @param last    One past the last scanline
+ * @param stats   If not null, every decoded row is also counted into these statistics
+ * @param alpha   If not null, the alpha channel of 32 bit images, sized like the image
+ * @return True if the rows were read and false otherwise
+ */
+bool decode_rows(int fd, const BmpInfo& info, const vector<Pixel>& palette,
+                 vector<vector<Pixel>>& image, int first, int last, ImageStats* stats,
+                 vector<vector<unsigned char>>* alpha = NULL) {
+    int chunk_rows = max(1LL, MAX_CHUNK_BYTES / info.row_bytes);
+    vector<unsigned char> buffer((long long)min(chunk_rows, last - first) * info.row_bytes);
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+
+    for (int chunk = first; chunk < last; chunk = chunk + chunk_rows)
+    {
+        int chunk_end = min(last, chunk + chunk_rows);
+        long long offset = info.start + (long long)chunk * info.row_bytes;
+        if (!pread_all(fd, buffer.data(), (long long)(chunk_end - chunk) * info.row_bytes, offset))
+        {
+            return false;
+        }
+
+        for (int r = chunk; r < chunk_end; r++)
+        {
+            // Note: BMP files store pixels from bottom to top, unless the height is negative
+            const unsigned char* row = &buffer[(long long)(r - chunk) * info.row_bytes];
+            vector<Pixel>& pixels = image[scanline_row(info, r)];
+            if (bytes_per_pixel == 4)
+            {
+                decode_bgra_row(row, pixels, alpha != NULL ? (*alpha)[scanline_row(info, r)].data() : NULL);
+            }
+            for (int j = 0; j < info.width && bytes_per_pixel != 4; j++)
+            {
+                if (bytes_per_pixel == 0 || bytes_per_pixel == 1)
+                {
+                    pixels[j] = palette[get_packed_index(row, j, info.bits_per_pixel)];
+                }
+                else
+                {
+                    // Note: BMP files store pixels in blue, green, red order
+                    const unsigned char* pixel = row + j * bytes_per_pixel;
+                    pixels[j].blue = pixel[0];
+                    pixels[j].green = pixel[1];
+                    pixels[j].red = pixel[2];
+                }
+            }
+            if (stats != NULL)
+            {
+                add_row_stats(*stats, pixels);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads a BMP image of any of the formats write_bmp() produces.
+ * Unlike read_image() this accepts 1, 4 and 8 bit palettized images
+ * (uncompressed, BI_RLE8 or BI_RLE4) as well as 24 and 32 bit images,
+ * including 32 bit BGRA bit fields and top down (negative height) images.
+ * Uncompressed pixel arrays are split into row bands that are read and
+ * unpacked by separate threads.
+ * @param filename BMP image filename
+ * @param stats    If not null, filled in with the image statistics while decoding
+ * @param alpha    If not null, filled in with the alpha channel of 32 bit images, or left
+ *                 empty if the image has none (all alpha 0 in an uncompressed image means none)
+ * @return the image as a vector of vector of Pixels, empty if not a valid image
+ */
+vector<vector<Pixel>> read_bmp(string filename, ImageStats* stats = NULL,
+                               vector<vector<unsigned char>>* alpha = NULL) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return {};
+    }
+
+    BmpInfo info;
+    vector<Pixel> palette;
+    if (!read_bmp_info(fd, info, palette))
+    {
+        close(fd);
+        return {};
+    }
+
+    int width = info.width;
+    int height = info.height;
+    vector<vector<Pixel>> image(height, vector<Pixel> (width));
+    bool ok = true;
+    mutex lock;
+    if (stats != NULL)
+    {
+        clear_stats(*stats);
+    }
+
+    bool has_alpha = alpha != NULL && info.bits_per_pixel == 32;
+    if (alpha != NULL)
+    {
+        alpha->assign(has_alpha ? height : 0, vector<unsigned char> (width));
+    }
+
+    if (info.compression == BMP_BI_RGB || info.compression == BMP_BI_BITFIELDS)
+    {
+        // Each band counts its own statistics and merges them when it is done
+        ok = parallel_rows(height, info.row_bytes, [&](int first, int last) {
+            ImageStats band;
+            clear_stats(band);
+            bool band_ok = decode_rows(fd, info, palette, image, first, last, stats != NULL ? &band : NULL,
+                                       has_alpha ? alpha : NULL);
+            if (stats != NULL)
+            {
+                lock_guard<mutex> guard(lock);
+                merge_stats(*stats, band);
+            }
+            return band_ok;
+        });
+    }
+    else
+    {
+        // Run length encoded data does not have fixed scanline offsets
+        vector<unsigned char> data(info.file_size);
+        vector<vector<unsigned char>> indexes;
+        ok = pread_all(fd, data.data(), info.file_size, 0) &&
+             decode_rle(data, info.start, width, height, info.bits_per_pixel, indexes);
+        for (int i = 0; ok && i < height; i++)
+        {
+            for (int j = 0; j < width; j++)
+            {
+                image[height - 1 - i][j] = palette[indexes[i][j]];
+            }
+            if (stats != NULL)
+            {
+                add_row_stats(*stats, image[height - 1 - i]);
+            }
+        }
+        if (stats != NULL)
+        {
+            finish_stats(*stats);
+        }
+    }
+
+    // Uncompressed 32 bit images often leave the fourth byte unused as 0
+    if (has_alpha && info.compression == BMP_BI_RGB)
+    {
+        bool unused = true;
+        for (int i = 0; i < height && unused; i++)
+        {
+            unused = count((*alpha)[i].begin(), (*alpha)[i].end(), 0) == width;
+        }
+        if (unused)
+        {
+            alpha->clear();
+        }
+    }
+
+    close(fd);
+    if (!ok)
+    {
+        return {};
+    }
+    return image;
+}
+
+/**
+ * Builds the palette for an image and maps every pixel to its palette index.
+ * Gray images written at 8 bits use the identity gray palette so no lookup is needed.
+ * Helper function for write_bmp()
+ * @param image          The input image
+ * @param bits_per_pixel Bits per palette index (1, 4 or 8)
+ * @param palette        Output, the packed 0xRRGGBB palette colors
+ * @param indexes        Output, the palette index of every pixel
+ * @return True if the image fits in 2^bits_per_pixel colors and false otherwise
+ */
+bool build_palette(const vector<vector<Pixel>>& image, int bits_per_pixel,
+                   vector<int>& palette, vector<vector<unsigned char>>& indexes) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    int max_colors = 1 << bits_per_pixel;
+    indexes.assign(num_rows, vector<unsigned char> (num_columns));
+    palette.clear();
+
+    // Try the identity gray palette first
+    bool gray = bits_per_pixel == 8;
+    for (int row = 0; row < num_rows && gray; row++)
+    {
+        for (int col = 0; col < num_columns && gray; col++)
+        {
+            int value = image[row][col].red & 255;
+            gray = (image[row][col].green & 255) == value && (image[row][col].blue & 255) == value;
+            indexes[row][col] = value;
+        }
+    }
+    if (gray)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            palette.push_back((i << 16) | (i << 8) | i);
+        }
+        return true;
+    }
+
+    int last_color = -1;
+    int last_index = 0;
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_columns; col++)
+        {
+            int color = pack_color(image[row][col]);
+            if (color != last_color)
+            {
+                int index = 0;
+                while (index < (int)palette.size() && palette[index] != color)
+                {
+                    index++;
+                }
+                if (index == (int)palette.size())
+                {
+                    if (index == max_colors)
+                    {
+                        return false;
+                    }
+                    palette.push_back(color);
+                }
+                last_color = color;
+                last_index = index;
+            }
+            indexes[row][col] = last_index;
+        }
+    }
+    return true;
+}
+
+/**
+ * Run length encodes one row of palette indexes as BI_RLE8 or BI_RLE4.
+ * Helper function for write_bmp()
+ * @param row            The palette indexes of the row
+ * @param bits_per_pixel 8 for RLE8, 4 for RLE4
+ * @param out            Encoded bytes are appended here (without the end of line marker)
+ * @return nothing
+ */
+void encode_rle_row(const vector<unsigned char>& row, int bits_per_pixel, vector<unsigned char>& out) {
+    int width = row.size();
+    int col = 0;
+
+    while (col < width)
+    {
+        // Length of the run of identical indexes starting here
+        int run = 1;
+        while (col + run < width && run < 255 && row[col + run] == row[col])
+        {
+            run++;
+        }
+
+        if (run >= 3)
+        {
+            int value = (bits_per_pixel == 8) ? row[col] : (row[col] << 4) | row[col];
+            out.push_back(run);
+            out.push_back(value);
+            col = col + run;
+            continue;
+        }
+
+        // Gather literal pixels until the next run of three or more begins
+        int literal = 0;
+        while (col + literal < width && literal < 255)
+        {
+            int ahead = col + literal;
+            if (ahead + 2 < width && row[ahead] == row[ahead + 1] && row[ahead] == row[ahead + 2])
+            {
+                break;
+            }
+            literal++;
+        }
+
+        // Several decoders drop the last pixel of an odd length RLE4 literal, so keep them even
+        if (bits_per_pixel == 4 && literal >= 3 && literal % 2 != 0)
+        {
+            literal--;
+        }
+
+        if (literal < 3)
+        {
+            // Absolute mode needs at least three pixels, so emit short runs instead
+            for (int i = 0; i < literal; i++)
+            {
+                int value = (bits_per_pixel == 8) ? row[col + i] : (row[col + i] << 4) | row[col + i];
+                out.push_back(1);
+                out.push_back(value);
+            }
+        }
+        else
+        {
+            out.push_back(0);
+            out.push_back(literal);
+            int literal_bytes = 0;
+            for (int i = 0; i < literal; i++)
+            {
+                if (bits_per_pixel == 8)
+                {
+                    out.push_back(row[col + i]);
+                    literal_bytes++;
+                }
+                else if (i % 2 == 0)
+                {
+                    out.push_back(row[col + i] << 4);
+                    literal_bytes++;
+                }
+                else
+                {
+                    out.back() |= row[col + i];
+                }
+            }
+            // Absolute runs are padded to a 16 bit boundary
+            if (literal_bytes % 2 != 0)
+            {
+                out.push_back(0);
+            }
+        }
+        col = col + literal;
+    }
+}
+
+/**
+ * Packs image rows into uncompressed scanlines [first, last) and writes them at their file offsets.
+ * Helper function for write_bmp(); every call owns its scanlines, so calls can run in parallel.
+ * @param fd      The open, already sized BMP file
+ * @param info    The image properties
+ * @param image   The image being saved
+ * @param indexes Palette index of every pixel for 1, 4 and 8 bit images
+ * @param first   First scanline (0 is the bottom row of the image)
+ * @param last    One past the last scanline
+ * @param alpha   Alpha value of every pixel for 32 bit images, if null they are opaque
+ * @return True if the rows were written and false otherwise
+ */
+bool encode_rows(int fd, const BmpInfo& info, const vector<vector<Pixel>>& image,
+                 const vector<vector<unsigned char>>& indexes, int first, int last,
+                 const vector<vector<unsigned char>>* alpha = NULL) {
+    int chunk_rows = max(1LL, MAX_CHUNK_BYTES / info.row_bytes);
+    vector<unsigned char> buffer;
+
+    for (int chunk = first; chunk < last; chunk = chunk + chunk_rows)
+    {
+        int chunk_end = min(last, chunk + chunk_rows);
+        buffer.assign((long long)(chunk_end - chunk) * info.row_bytes, 0);
+
+        for (int r = chunk; r < chunk_end; r++)
+        {
+            // Pixel Array (Left to right, bottom to top, with padding)
+            unsigned char* row = &buffer[(long long)(r - chunk) * info.row_bytes];
+            int h = info.height - 1 - r;
+            for (int w = 0; w < info.width; w++)
+            {
+                if (info.bits_per_pixel == 24)
+                {
+                    // Write the pixel (Blue, Green, Red)
+                    row[w * 3] = image[h][w].blue;
+                    row[w * 3 + 1] = image[h][w].green;
+                    row[w * 3 + 2] = image[h][w].red;
+                }
+                else if (info.bits_per_pixel == 32)
+                {
+                    // Write the pixel (Blue, Green, Red, Alpha)
+                    row[w * 4] = image[h][w].blue;
+                    row[w * 4 + 1] = image[h][w].green;
+                    row[w * 4 + 2] = image[h][w].red;
+                    row[w * 4 + 3] = alpha != NULL ? (*alpha)[h][w] : 255;
+                }
+                else
+                {
+                    set_packed_index(row, w, info.bits_per_pixel, indexes[h][w]);
+                }
+            }
+        }
+
+        long long offset = info.start + (long long)chunk * info.row_bytes;
+        if (!pwrite_all(fd, buffer.data(), buffer.size(), offset))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Creates a BMP file of its final size and writes the headers and palette,
+ * leaving the pixel array to be written at info.start
+ * @param filename    The BMP file name
+ * @param info        The image properties, start and file_size are filled in here
+ * @param palette     The packed 0xRRGGBB palette colors (empty for 24 bit images)
+ * @param array_bytes Size of the pixel array in bytes
+ * @return the open file descriptor, or -1 if the file could not be created
+ */
+int create_bmp(string filename, BmpInfo& info, const vector<int>& palette, long long array_bytes) {
+    // Create the BMP and DIB Headers, followed by the palette. 32 bit images get a
+    // BITMAPV4HEADER, the first header with an alpha mask.
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = info.bits_per_pixel == 32 ? 108 : 40;
+    info.top_down = false;
+    info.start = BMP_HEADER_SIZE + DIB_HEADER_SIZE + palette.size() * 4;
+    info.file_size = info.start + array_bytes;
+    if (info.file_size > 0xFFFFFFFFLL)
+    {
+        return -1;                                  // Too big for the 32 bit size fields
+    }
+    vector<unsigned char> header(info.start, 0);
+    unsigned char* bmp_header = &header[0];
+    unsigned char* dib_header = &header[BMP_HEADER_SIZE];
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, info.file_size);   // Size of BMP file
+    set_bytes(bmp_header, 10, 4, info.start);       // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, info.width);       // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, info.height);      // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, info.bits_per_pixel); // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, info.compression); // Compression method
+    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, palette.size());   // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+    if (info.bits_per_pixel == 32)
+    {
+        set_bytes(dib_header, 16, 4, BMP_BI_BITFIELDS);
+        set_bytes(dib_header, 40, 4, 0x00FF0000);   // Red mask
+        set_bytes(dib_header, 44, 4, 0x0000FF00);   // Green mask
+        set_bytes(dib_header, 48, 4, 0x000000FF);   // Blue mask
+        set_bytes(dib_header, 52, 4, 0xFF000000);   // Alpha mask
+        set_bytes(dib_header, 56, 4, 0x73524742);   // Color space ("sRGB")
+    }
+
+    // Palette entries are stored blue, green, red, reserved
+    for (int i = 0; i < (int)palette.size(); i++)
+    {
+        set_bytes(&header[BMP_HEADER_SIZE + DIB_HEADER_SIZE], i * 4, 3, palette[i]);
+    }
+
+    // Size the file up front so row bands can be written in any order
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (ftruncate(fd, info.file_size) != 0 || !pwrite_all(fd, header.data(), header.size(), 0))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Writes the image as a BMP. 1, 4 and 8 bit images are palettized; 4 and 8 bit
+ * images may also be run length encoded (BI_RLE4 / BI_RLE8), which is only used
+ * when it actually comes out smaller than the plain palettized pixel array.
+ * Falls back to 24 bits when the image has too many colors for the palette.
+ * Images with an alpha channel are saved as 32 bit BGRA.
+ * The file is sized up front and uncompressed row bands are encoded and written
+ * by separate threads.
+ * @param filename       The BMP file name to save the image to
+ * @param image          The input image to save
+ * @param bits_per_pixel 1, 4, 8 or 24
+ * @param allow_rle      Whether run length encoding may be used
+ * @param alpha          If not null, the alpha value of every pixel
+ * @return True if successful and false otherwise
+ */
+bool write_bmp(string filename, const vector<vector<Pixel>>& image, int bits_per_pixel, bool allow_rle,
+               const vector<vector<unsigned char>>* alpha = NULL) {
+    if (alpha != NULL)
+    {
+        bits_per_pixel = 32;
+    }
+
+    vector<int> palette;
+    vector<vector<unsigned char>> indexes;
+    if (bits_per_pixel < 24 && !build_palette(image, bits_per_pixel, palette, indexes))
+    {
+        bits_per_pixel = 24;
+        palette.clear();
+    }
+
+    BmpInfo info;
+    info.width = image[0].size();
+    info.height = image.size();
+    info.bits_per_pixel = bits_per_pixel;
+    info.compression = BMP_BI_RGB;
+    info.row_bytes = scanline_bytes(info.width, bits_per_pixel);
+    long long array_bytes = info.row_bytes * info.height;
+
+    // Try run length encoding and keep it only if it wins
+    vector<unsigned char> encoded;
+    if (allow_rle && (bits_per_pixel == 8 || bits_per_pixel == 4))
+    {
+        for (int h = info.height - 1; h >= 0 && (long long)encoded.size() < array_bytes; h--)
+        {
+            encode_rle_row(indexes[h], bits_per_pixel, encoded);
+            encoded.push_back(0);                   // End of line
+            encoded.push_back(0);
+        }
+        encoded.push_back(0);                       // End of bitmap
+        encoded.push_back(1);
+        if ((long long)encoded.size() < array_bytes)
+        {
+            info.compression = (bits_per_pixel == 8) ? BMP_BI_RLE8 : BMP_BI_RLE4;
+            array_bytes = encoded.size();
+        }
+    }
+
+    int fd = create_bmp(filename, info, palette, array_bytes);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = true;
+
+    if (info.compression == BMP_BI_RGB)
+    {
+        ok = parallel_rows(info.height, info.row_bytes, [&](int first, int last) {
+            return encode_rows(fd, info, image, indexes, first, last, alpha);
+        });
+    }
+    else
+    {
+        ok = pwrite_all(fd, encoded.data(), encoded.size(), info.start);
+    }
+
+    return close(fd) == 0 && ok;
+}
+
+//***************************************************************************************************//
+//                                KERNEL FRAMEWORK                                                   //
+//***************************************************************************************************//
+
+// Every effect is a small functor and the loop drivers below are templates, so each
+// effect (or fused chain of effects) compiles into its own fully inlined loop.
+//
+// Point kernels turn one pixel into another:
+//     Pixel operator()(const Pixel& pixel, int row, int col) const
+// Coordinate maps say which source pixel ends up at each output position:
+//     int rows(int num_rows, int num_columns) const
+//     int columns(int num_rows, int num_columns) const
+//     void source(int row, int col, int& src_row, int& src_col) const
+
+// Point kernel that leaves the pixel alone
+struct Unchanged
+{
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        return pixel;
+    }
+};
+
+// Point kernel that runs First and then Second on its result
+template <class First, class Second>
+struct Fused
+{
+    First first;
+    Second second;
+
+    Pixel operator()(const Pixel& pixel, int row, int col) const
+    {
+        return second(first(pixel, row, col), row, col);
+    }
+};
+
+/**
+ * Fuses two point kernels into one, so the chain runs in a single pass over the image
+ * @param first  Kernel applied first
+ * @param second Kernel applied to the result of first
+ * @return the fused kernel
+ */
+template <class First, class Second>
+Fused<First, Second> fuse(const First& first, const Second& second) {
+    Fused<First, Second> fused = {first, second};
+    return fused;
+}
+
+/**
+ * Runs a point kernel over every pixel, one band of rows per thread
+ * @param image  The input image
+ * @param kernel The point kernel
+ * @return vector of vectors of type Pixel
+ */
+template <class Kernel>
+vector<vector<Pixel>> apply_kernel(const vector<vector<Pixel>>& image, const Kernel& kernel) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+
+    parallel_rows(num_rows, num_columns * 3, [&](int first, int last) {
+        for (int row = first; row < last; row++)
+        {
+            for (int col = 0; col < num_columns; col++)
+            {
+                new_image[row][col] = kernel(image[row][col], row, col);
+            }
+        }
+        return true;
+    });
+
+    return new_image;
+}
+
+/**
+ * Moves pixels according to a coordinate map and runs a point kernel on them on the way
+ * @param image  The input image
+ * @param map    The coordinate map
+ * @param kernel The point kernel, given the output row and column
+ * @return vector of vectors of type Pixel
+ */
+template <class Map, class Kernel>
+vector<vector<Pixel>> apply_map(const vector<vector<Pixel>>& image, const Map& map, const Kernel& kernel) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    int new_rows = map.rows(num_rows, num_columns);
+    int new_columns = map.columns(num_rows, num_columns);
+    vector<vector<Pixel>> new_image(new_rows, vector<Pixel> (new_columns));
+
+    if (new_columns <= 0)
+    {
+        return new_image;
+    }
+
+    parallel_rows(new_rows, new_columns * 3, [&](int first, int last) {
+        for (int row = first; row < last; row++)
+        {
+            // Column 0 is peeled off the inner loop, so checks maps make for it fold away there
+            int src_row = 0;
+            int src_col = 0;
+            map.source(row, 0, src_row, src_col);
+            new_image[row][0] = kernel(image[src_row][src_col], row, 0);
+            for (int col = 1; col < new_columns; col++)
+            {
+                map.source(row, col, src_row, src_col);
+                new_image[row][col] = kernel(image[src_row][src_col], row, col);
+            }
+        }
+        return true;
+    });
+
+    return new_image;
+}
+
+/**
+ * Moves pixels according to a coordinate map
+ * @param image The input image
+ * @param map   The coordinate map
+ * @return vector of vectors of type Pixel
+ */
+template <class Map>
+vector<vector<Pixel>> apply_map(const vector<vector<Pixel>>& image, const Map& map) {
+    return apply_map(image, map, Unchanged());
+}
+
+//***************************************************************************************************//
+//                                EFFECTS                                                            //
+//***************************************************************************************************//
+
+// Vignette point kernel
+struct Vignette
+{
+    int num_rows;
+    int num_columns;
+
+    Pixel operator()(const Pixel& pixel, int row, int col) const
+    {
+        // find the distance to the center
+        double distance = sqrt(pow((col - num_columns/2), 2) + pow((row - num_rows/2),2));
+        double scaling_factor = (num_rows - distance)/num_rows;
+
+        int newred = pixel.red * scaling_factor;
+        int newgreen = pixel.green * scaling_factor;
+        int newblue = pixel.blue * scaling_factor;
+        return Pixel {newred, newgreen, newblue};
+    }
+};
+
+/**
+ * Adds vignette effect - dark corners
+ * @param image The input image to add effect to
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_1(vector<vector<Pixel>> image) {
+    Vignette vignette = {(int)image.size(), (int)image[0].size()};
+    return apply_kernel(image, vignette);
+}
+
+// Clarendon point kernel
+struct Clarendon
+{
+    double scaling_factor;
+    int dark_band;
+    int light_band;
+
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        int average_color_value = (pixel.red + pixel.green + pixel.blue)/3;
+
+        if (average_color_value >= light_band)
+        {
+            int newred = int(255 - (255 - pixel.red)*scaling_factor);
+            int newgreen = int(255 - (255 - pixel.green)*scaling_factor);
+            int newblue = int(255 - (255 - pixel.blue)*scaling_factor);
+            return Pixel {newred, newgreen, newblue};
+        }
+        else if (average_color_value < dark_band)
+        {
+            int newred = pixel.red * scaling_factor;
+            int newgreen = pixel.green * scaling_factor;
+            int newblue = pixel.blue * scaling_factor;
+            return Pixel {newred, newgreen, newblue};
+        }
+        return pixel;
+    }
+};
+
+/**
+ * Adds clarendon type effect - darks darker and lights lighter
+ * @param image The input image to add effect to
+ * @param scaling_factor The amount the darks will darken and lights will lighten
+ * @param dark_band Pixels with an average color value below this are darkened
+ * @param light_band Pixels with an average color value at or above this are lightened
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_2_bands(const vector<vector<Pixel>>& image, double scaling_factor, int dark_band, int light_band) {
+    Clarendon clarendon = {scaling_factor, dark_band, light_band};
+    return apply_kernel(image, clarendon);
+}
+
+/**
+ * Adds clarendon type effect - darks darker and lights lighter
+ * @param image The input image to add effect to
+ * @param scaling_factor The amount the darks will darken and lights will lighten
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_2(vector<vector<Pixel>> image, double scaling_factor) {
+    return process_2_bands(image, scaling_factor, 90, 170);
+}
+
+// Grayscale point kernel
+struct Grayscale
+{
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        int gray_value = (pixel.red + pixel.green + pixel.blue)/3;
+        return Pixel {gray_value, gray_value, gray_value};
+    }
+};
+
+/**
+ * Greyscale the image
+ * @param image The input image to add effect to
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_3(vector<vector<Pixel>> image) {
+    return apply_kernel(image, Grayscale());
+}
+
+// Coordinate map for the turns of process_5. Turns is fixed at compile time, so the
+// branches below fold away and each rotation gets its own loop.
+//   1: rotate 90 degrees
+//   2: rotate 180 degrees
+//   3: swap rows and columns
+template <int Turns>
+struct Rotate
+{
+    static_assert(Turns >= 0 && Turns < 4, "Turns must be between 0 and 3");
+
+    int num_rows;
+    int num_columns;
+
+    int rows(int image_rows, int image_columns) const
+    {
+        return (Turns % 2 == 0) ? image_rows : image_columns;
+    }
+
+    int columns(int image_rows, int image_columns) const
+    {
+        return (Turns % 2 == 0) ? image_columns : image_rows;
+    }
+
+    void source(int row, int col, int& src_row, int& src_col) const
+    {
+        if (Turns == 0)
+        {
+            src_row = row;
+            src_col = col;
+        }
+        else if (Turns == 1)
+        {
+            // Column 0 wraps around to the first row
+            src_row = (col == 0) ? 0 : num_rows - col;
+            src_col = row;
+        }
+        else if (Turns == 2)
+        {
+            src_row = num_rows - row - 1;
+            src_col = (col == 0) ? 0 : num_columns - col;
+        }
+        else
+        {
+            src_row = col;
+            src_col = row;
+        }
+    }
+};
+
+/**
+ * Rotates by a fixed number of turns
+ * @param image The input image to add effect to
+ * @return vector of vectors of type Pixel
+ */
+template <int Turns>
+vector<vector<Pixel>> rotate(const vector<vector<Pixel>>& image) {
+    Rotate<Turns> map = {(int)image.size(), (int)image[0].size()};
+    return apply_map(image, map);
+}
+
+/**
+ * Rotates by 90 degrees
+ * @param image The input image to add effect to
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_4(vector<vector<Pixel>> image) {
+    return rotate<1>(image);
+}
+
+/**
+ * Rotates by multiples of 90 degrees
+ * @param image The input image to add effect to
+ * @param rotations The number of times to rotate the image
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_5(vector<vector<Pixel>> image, int rotations) {
+    int angle = rotations * 90;
+    if ((angle%360) == 0)
+    {
+        return image;
+    }
+    else if ((angle%360) == 90)
+    {
+        return rotate<1>(image);
+    }
+    else if ((angle%360) == 180)
+    {
+        return rotate<2>(image);
+    }
+    return rotate<3>(image);
+}
+
+// Coordinate map that repeats every pixel x times across and y times down
+struct Enlarge
+{
+    int x;
+    int y;
+
+    int rows(int image_rows, int) const
+    {
+        return image_rows * y;
+    }
+
+    int columns(int, int image_columns) const
+    {
+        return image_columns * x;
+    }
+
+    void source(int row, int col, int& src_row, int& src_col) const
+    {
+        src_row = row/y;
+        src_col = col/x;
+    }
+};
+
+/**
+ * Enlarges in the x and y direction
+ * @param image The input image to add effect to
+ * @param x The amount to grow the image horizontally
+ * @param y The amount to grow the image vertically
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_6(vector<vector<Pixel>> image, int x, int y) {
+    Enlarge enlarge = {x, y};
+    return apply_map(image, enlarge);
+}
+
+// Point kernel that turns a grayscale pixel black or white, run after Grayscale
+struct Threshold
+{
+    int threshold;
+
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        int value = (pixel.red >= threshold) ? 255 : 0;
+        return Pixel {value, value, value};
+    }
+};
+
+// High contrast point kernel, grayscale and threshold fused into one pass
+typedef Fused<Grayscale, Threshold> HighContrast;
+
+/**
+ * Builds the high contrast kernel
+ * @param threshold Pixels with an average color value at or above this turn white
+ * @return the fused kernel
+ */
+HighContrast high_contrast_kernel(int threshold) {
+    Threshold binarize = {threshold};
+    return fuse(Grayscale(), binarize);
+}
+
+/**
+ * Converts image to high contrast - black and white only
+ * @param image The input image to add effect to
+ * @param threshold Pixels with an average color value at or above this turn white
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_7_threshold(const vector<vector<Pixel>>& image, int threshold) {
+    return apply_kernel(image, high_contrast_kernel(threshold));
+}
+
+/**
+ * Converts image to high contrast - black and white only
+ * @param image The input image to add effect to
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_7(vector<vector<Pixel>> image) {
+    return process_7_threshold(image, 255/2);
+}
+
+// Lighten point kernel
+struct Lighten
+{
+    double scaling_factor;
+
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        int newred = 255 - (255 - pixel.red) * scaling_factor;
+        int newgreen = 255 - (255 - pixel.green) * scaling_factor;
+        int newblue = 255 - (255 - pixel.blue) * scaling_factor;
+        return Pixel {newred, newgreen, newblue};
+    }
+};
+
+/**
+ * Lightens image
+ * @param image The input image to add effect to
+ * @param scaling_factor The degree the image should be lightened
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_8(vector<vector<Pixel>> image, double scaling_factor) {
+    Lighten lighten = {scaling_factor};
+    return apply_kernel(image, lighten);
+}
+
+// Darken point kernel
+struct Darken
+{
+    double scaling_factor;
+
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        int newred = pixel.red * scaling_factor;
+        int newgreen = pixel.green * scaling_factor;
+        int newblue = pixel.blue * scaling_factor;
+        return Pixel {newred, newgreen, newblue};
+    }
+};
+
+/**
+ * Darkens image
+ * @param image The input image to add effect to
+ * @param scaling_factor The degree the image should be darkened
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_9(vector<vector<Pixel>> image, double scaling_factor) {
+    Darken darken = {scaling_factor};
+    return apply_kernel(image, darken);
+}
+
+// Black, white, red, green, blue point kernel
+struct FiveColor
+{
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        int red_color = pixel.red;
+        int green_color = pixel.green;
+        int blue_color = pixel.blue;
+
+        int max_color = red_color;
+        if (green_color > red_color && green_color > blue_color)
+        {
+            max_color = green_color;
+        }
+        else if (blue_color > red_color && blue_color > green_color)
+        {
+            max_color = blue_color;
+        }
+
+        if (red_color + green_color + blue_color >= 550)
+        {
+            return Pixel {255, 255, 255};
+        }
+        else if (red_color + green_color + blue_color <= 150)
+        {
+            return Pixel {0, 0, 0};
+        }
+        else if (max_color == red_color)
+        {
+            return Pixel {255, 0, 0};
+        }
+        else if (max_color == green_color)
+        {
+            return Pixel {0, 255, 0};
+        }
+        return Pixel {0, 0, 255};
+    }
+};
+
+/**
+ * Converts to only black, white, red, blue and green
+ * @param image The input image to add effect to
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_10(vector<vector<Pixel>> image) {
+    return apply_kernel(image, FiveColor());
+}
+
+//***************************************************************************************************//
+//                                AUTO ADJUSTMENTS                                                   //
+//***************************************************************************************************//
+
+/**
+ * Converts image to high contrast, splitting dark from light at the Otsu threshold
+ * @param image The input image to add effect to
+ * @param stats The image statistics
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_7_auto(const vector<vector<Pixel>>& image, const ImageStats& stats) {
+    return process_7_threshold(image, otsu_threshold(stats) + 1);
+}
+
+/**
+ * Adds clarendon type effect with the dark and light bands placed at the same share of
+ * the image's own pixels that 90 and 170 cover on an evenly spread image
+ * @param image The input image to add effect to
+ * @param scaling_factor The amount the darks will darken and lights will lighten
+ * @param stats The image statistics
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_2_auto(const vector<vector<Pixel>>& image, double scaling_factor, const ImageStats& stats) {
+    int dark_band = stats_percentile(stats, STATS_GRAY, 90 / 255.0);
+    int light_band = max(dark_band, stats_percentile(stats, STATS_GRAY, 170 / 255.0));
+    return process_2_bands(image, scaling_factor, dark_band, light_band);
+}
+
+// Per channel lookup table point kernel
+struct Levels
+{
+    int levels[3][256];
+
+    Pixel operator()(const Pixel& pixel, int, int) const
+    {
+        return Pixel {levels[0][pixel.red & 255], levels[1][pixel.green & 255], levels[2][pixel.blue & 255]};
+    }
+};
+
+/**
+ * Stretches every channel so its darkest and lightest values (ignoring the
+ * extreme 0.5% at each end) cover the full 0 to 255 range
+ * @param image The input image to add effect to
+ * @param stats The image statistics
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_auto_levels(const vector<vector<Pixel>>& image, const ImageStats& stats) {
+    int channels[3] = {STATS_RED, STATS_GREEN, STATS_BLUE};
+    Levels levels;
+    for (int c = 0; c < 3; c++)
+    {
+        int low = stats_percentile(stats, channels[c], 0.005);
+        int high = stats_percentile(stats, channels[c], 0.995);
+        for (int value = 0; value < 256; value++)
+        {
+            levels.levels[c][value] = value;
+            if (high > low)
+            {
+                levels.levels[c][value] = min(255, max(0, (value - low) * 255 / (high - low)));
+            }
+        }
+    }
+    return apply_kernel(image, levels);
+}
+
+//***************************************************************************************************//
+//                                RESAMPLING                                                         //
+//***************************************************************************************************//
+
+// Resampling filters
+const int RESAMPLE_NEAREST = 0;
+const int RESAMPLE_BILINEAR = 1;
+const int RESAMPLE_BOX = 2;
+
+// Precomputed filter taps along one axis
+struct ResampleTaps
+{
+    vector<int> first;     // First source index used by each output index
+    vector<int> count;     // Number of source indexes used by each output index
+    vector<float> weights; // count[i] weights for output index i, starting at i * max_taps
+    int max_taps;          // Largest count, also the stride of weights
+};
+
+/**
+ * Works out which source pixels, and how much of each, make up every output pixel along one axis.
+ * Shrinking widens bilinear and box filters by the scale so every source pixel contributes.
+ * @param in_size  Number of source pixels along the axis
+ * @param out_size Number of output pixels along the axis
+ * @param filter   RESAMPLE_NEAREST, RESAMPLE_BILINEAR or RESAMPLE_BOX
+ * @return the taps for every output index
+ */
+ResampleTaps build_taps(int in_size, int out_size, int filter) {
+    double scale = (double)in_size / out_size;
+    double support = max(scale, 1.0);
+    ResampleTaps taps;
+    taps.max_taps = (filter == RESAMPLE_NEAREST) ? 1 : (int)ceil(support) * 2 + 2;
+    taps.first.assign(out_size, 0);
+    taps.count.assign(out_size, 0);
+    taps.weights.assign((long long)out_size * taps.max_taps, 0.0f);
+
+    for (int i = 0; i < out_size; i++)
+    {
+        float* weights = &taps.weights[(long long)i * taps.max_taps];
+
+        if (filter == RESAMPLE_NEAREST)
+        {
+            // Same pixel as process_6 picks (col / x) for whole number scales
+            taps.first[i] = min(in_size - 1, (int)((2LL * i + 1) * in_size / (2LL * out_size)));
+            taps.count[i] = 1;
+            weights[0] = 1.0f;
+            continue;
+        }
+
+        double center = (i + 0.5) * scale;
+        int left = max(0, (int)floor(center - support));
+        int right = min(in_size - 1, (int)ceil(center + support));
+        double total = 0;
+        int count = 0;
+        for (int j = left; j <= right && count < taps.max_taps; j++)
+        {
+            double weight = 0;
+            if (filter == RESAMPLE_BILINEAR)
+            {
+                weight = max(0.0, 1.0 - fabs((j + 0.5 - center) / support));
+            }
+            else
+            {
+                // Area of source pixel j covered by the output pixel
+                weight = max(0.0, min(j + 1.0, center + support / 2) - max((double)j, center - support / 2));
+            }
+            if (weight <= 0 && count == 0)
+            {
+                left++;
+                continue;
+            }
+            weights[count] = weight;
+            total = total + weight;
+            count++;
+        }
+
+        // Drop trailing zero weights and normalize so flat areas stay flat
+        while (count > 1 && weights[count - 1] <= 0)
+        {
+            count--;
+        }
+        if (total <= 0)
+        {
+            left = min(in_size - 1, (int)center);
+            count = 1;
+            weights[0] = 1.0f;
+            total = 1;
+        }
+        for (int t = 0; t < count; t++)
+        {
+            weights[t] = weights[t] / total;
+        }
+        taps.first[i] = left;
+        taps.count[i] = count;
+    }
+    return taps;
+}
+
+/**
+ * Horizontal pass: resamples one row of 4 floats per pixel (blue, green, red, unused)
+ * @param src       Source row, 4 floats per source pixel
+ * @param dst       Output row, 4 floats per output pixel
+ * @param taps      Horizontal taps
+ * @param out_width Number of output pixels
+ * @return nothing
+ */
+void resample_row(const float* src, float* dst, const ResampleTaps& taps, int out_width) {
+    for (int x = 0; x < out_width; x++)
+    {
+        const float* weights = &taps.weights[(long long)x * taps.max_taps];
+        const float* pixel = src + 4 * taps.first[x];
+#ifdef __SSE2__
+        __m128 sum = _mm_setzero_ps();
+        for (int t = 0; t < taps.count[x]; t++)
+        {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(pixel + 4 * t)));
+        }
+        _mm_storeu_ps(dst + 4 * x, sum);
+#else
+        float sum[4] = {0, 0, 0, 0};
+        for (int t = 0; t < taps.count[x]; t++)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                sum[c] = sum[c] + weights[t] * pixel[4 * t + c];
+            }
+        }
+        for (int c = 0; c < 4; c++)
+        {
+            dst[4 * x + c] = sum[c];
+        }
+#endif
+    }
+}
+
+/**
+ * Vertical pass: blends already horizontally resampled rows into one output row
+ * @param rows    The source rows, in order
+ * @param weights One weight per source row
+ * @param count   Number of source rows
+ * @param dst     Output row
+ * @param floats  Floats per row (a multiple of 4)
+ * @return nothing
+ */
+void blend_rows(const float* const rows[], const float weights[], int count, float* dst, int floats) {
+    for (int k = 0; k < floats; k = k + 4)
+    {
+#ifdef __SSE2__
+        __m128 sum = _mm_setzero_ps();
+        for (int t = 0; t < count; t++)
+        {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(rows[t] + k)));
+        }
+        _mm_storeu_ps(dst + k, sum);
+#else
+        for (int c = 0; c < 4; c++)
+        {
+            float sum = 0;
+            for (int t = 0; t < count; t++)
+            {
+                sum = sum + weights[t] * rows[t][k + c];
+            }
+            dst[k + c] = sum;
+        }
+#endif
+    }
+}
+
+/**
+ * Rounds a filtered value back to a color value
+ * @param value The filtered value
+ * @return the value rounded and clamped to 0-255
+ */
+int to_color(float value) {
+    return min(255, max(0, (int)(value + 0.5f)));
+}
+
+/**
+ * Resamples the image to any size, producing the output one row at a time, bottom row first.
+ * Each source row is horizontally resampled once and kept in a small ring of rows until
+ * every output row that needs it has been blended, so the output never sits in memory.
+ * @param image      The input image
+ * @param new_width  Output width in pixels
+ * @param new_height Output height in pixels
+ * @param filter     RESAMPLE_NEAREST, RESAMPLE_BILINEAR or RESAMPLE_BOX
+ * @param emit       Called as emit(row, values) with 4 floats per pixel (blue, green, red, unused),
+ *                   returns false to stop
+ * @return True if every row was emitted and false otherwise
+ */
+bool resample_rows(const vector<vector<Pixel>>& image, int new_width, int new_height, int filter,
+                   const function<bool(int, const float*)>& emit) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    ResampleTaps x_taps = build_taps(num_columns, new_width, filter);
+    ResampleTaps y_taps = build_taps(num_rows, new_height, filter);
+
+    // Ring of horizontally resampled source rows, slot = source row % ring size
+    int ring_size = y_taps.max_taps;
+    vector<vector<float>> ring(ring_size, vector<float> (new_width * 4));
+    vector<int> ring_row(ring_size, -1);
+    vector<float> source(num_columns * 4, 0.0f);
+    vector<float> output(new_width * 4);
+    vector<const float*> rows(ring_size);
+
+    for (int y = new_height - 1; y >= 0; y--)
+    {
+        int first = y_taps.first[y];
+        int count = y_taps.count[y];
+        for (int t = 0; t < count; t++)
+        {
+            int src_row = first + t;
+            int slot = src_row % ring_size;
+            if (ring_row[slot] != src_row)
+            {
+                for (int col = 0; col < num_columns; col++)
+                {
+                    source[col * 4] = image[src_row][col].blue;
+                    source[col * 4 + 1] = image[src_row][col].green;
+                    source[col * 4 + 2] = image[src_row][col].red;
+                }
+                resample_row(source.data(), ring[slot].data(), x_taps, new_width);
+                ring_row[slot] = src_row;
+            }
+            rows[t] = ring[slot].data();
+        }
+
+        blend_rows(rows.data(), &y_taps.weights[(long long)y * y_taps.max_taps], count,
+                   output.data(), new_width * 4);
+        if (!emit(y, output.data()))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Resizes the image straight into a 24 bit BMP file, one scanline at a time,
+ * so only a few rows of the output are ever in memory
+ * @param filename   The BMP file name to save the image to
+ * @param image      The input image
+ * @param new_width  Output width in pixels
+ * @param new_height Output height in pixels
+ * @param filter     RESAMPLE_NEAREST, RESAMPLE_BILINEAR or RESAMPLE_BOX
+ * @return True if successful and false otherwise
+ */
+bool resample_to_file(string filename, const vector<vector<Pixel>>& image, int new_width, int new_height, int filter) {
+    if (new_width <= 0 || new_height <= 0)
+    {
+        return false;
+    }
+
+    BmpInfo info;
+    info.width = new_width;
+    info.height = new_height;
+    info.bits_per_pixel = 24;
+    info.compression = BMP_BI_RGB;
+    info.row_bytes = scanline_bytes(new_width, 24);
+    int fd = create_bmp(filename, info, vector<int> (), info.row_bytes * new_height);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // Rows arrive bottom first, which is also the order they sit in the file
+    vector<unsigned char> scanline(info.row_bytes, 0);
+    bool ok = resample_rows(image, new_width, new_height, filter, [&](int row, const float* values) {
+        for (int col = 0; col < new_width; col++)
+        {
+            scanline[col * 3] = to_color(values[col * 4]);
+            scanline[col * 3 + 1] = to_color(values[col * 4 + 1]);
+            scanline[col * 3 + 2] = to_color(values[col * 4 + 2]);
+        }
+        long long offset = info.start + (long long)(new_height - 1 - row) * info.row_bytes;
+        return pwrite_all(fd, scanline.data(), info.row_bytes, offset);
+    });
+
+    return close(fd) == 0 && ok;
+}
+
+//***************************************************************************************************//
+//                                CONVOLUTION                                                        //
+//***************************************************************************************************//
+
+// Blur kernels
+const int KERNEL_BOX = 0;
+const int KERNEL_GAUSSIAN = 1;
+
+// Blurs run over strips of this many columns, so the rows each vertical pass keeps stay in cache
+const int BLUR_TILE_COLUMNS = 512;
+
+// Blurs work on colors in fixed point with this many fraction bits. Integer running sums are
+// exact, so a pixel comes out the same whichever band or strip of the image it was blurred in.
+const int BLUR_FRACTION_BITS = 8;
+
+// Largest blur radius, so a window of fixed point colors still sums to less than 2^31
+const int MAX_BLUR_RADIUS = 16000;
+
+// One vertical box pass. Keeps a ring of its input rows and a running sum of the
+// 2 * radius + 1 rows around the current row, so each output row costs the same
+// however large the radius is.
+struct BoxStage
+{
+    int radius;                 // Box radius in rows
+    vector<vector<int>> ring;   // Input rows, slot = row % ring size
+    vector<int> ring_row;       // Which input row each slot holds
+    vector<int> sum;            // Running sum of the input window
+    vector<int> out;            // The last output row
+    int current;                // Row the running sum is centered on, -1 before the first row
+};
+
+/**
+ * Divides a box sum by the window size, rounding to the nearest fixed point value
+ * @param sum   The sum of the window
+ * @param scale 1 / window size
+ * @return the average
+ */
+int box_average(int sum, float scale) {
+    return (int)(sum * scale + 0.5f);
+}
+
+#ifdef __SSE2__
+/**
+ * Divides four box sums by the window size, rounding the same way as the scalar version
+ * @param sum   The sums of the window
+ * @param scale 1 / window size in every lane
+ * @return the averages
+ */
+__m128i box_average(__m128i sum, __m128 scale) {
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale), _mm_set1_ps(0.5f)));
+}
+#endif
+
+/**
+ * Rounds a fixed point blurred value back to a color value
+ * @param value The value, with BLUR_FRACTION_BITS fraction bits
+ * @return the color value
+ */
+int fixed_to_color(int value) {
+    return min(255, (value + (1 << (BLUR_FRACTION_BITS - 1))) >> BLUR_FRACTION_BITS);
+}
+
+/**
+ * Adds one row to and removes another from a running sum, then scales it into an output row
+ * @param sum    Running sum, updated in place
+ * @param add    Row entering the window (may be null)
+ * @param sub    Row leaving the window (may be null)
+ * @param out    Output row, sum / window size
+ * @param scale  1 / window size
+ * @param values Values per row (a multiple of 4)
+ * @return nothing
+ */
+void slide_rows(int* sum, const int* add, const int* sub, int* out, float scale, int values) {
+    for (int k = 0; k < values; k = k + 4)
+    {
+#ifdef __SSE2__
+        __m128i s = _mm_loadu_si128((const __m128i*)(sum + k));
+        if (add != NULL)
+        {
+            s = _mm_add_epi32(s, _mm_loadu_si128((const __m128i*)(add + k)));
+        }
+        if (sub != NULL)
+        {
+            s = _mm_sub_epi32(s, _mm_loadu_si128((const __m128i*)(sub + k)));
+        }
+        _mm_storeu_si128((__m128i*)(sum + k), s);
+        _mm_storeu_si128((__m128i*)(out + k), box_average(s, _mm_set1_ps(scale)));
+#else
+        for (int c = k; c < k + 4; c++)
+        {
+            if (add != NULL)
+            {
+                sum[c] = sum[c] + add[c];
+            }
+            if (sub != NULL)
+            {
+                sum[c] = sum[c] - sub[c];
+            }
+            out[c] = box_average(sum[c], scale);
+        }
+#endif
+    }
+}
+
+/**
+ * Box blurs one row of 4 values per pixel in place with a running sum, repeating the edge pixels
+ * @param row     The row, 4 fixed point values per pixel
+ * @param scratch Scratch space of the same size
+ * @param width   Pixels in the row
+ * @param radius  Box radius in pixels
+ * @return nothing
+ */
+void box_blur_row(int* row, int* scratch, int width, int radius) {
+    float scale = 1.0f / (2 * radius + 1);
+#ifdef __SSE2__
+    // One pixel's 4 values per SIMD register, so every step is a single add, subtract and divide
+    __m128i sum = _mm_setzero_si128();
+    for (int k = -radius; k <= radius; k++)
+    {
+        int x = min(width - 1, max(0, k));
+        sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(row + x * 4)));
+    }
+
+    __m128 scales = _mm_set1_ps(scale);
+    for (int x = 0; x < width; x++)
+    {
+        int add = min(width - 1, x + radius + 1);
+        int sub = max(0, x - radius);
+        _mm_storeu_si128((__m128i*)(scratch + x * 4), box_average(sum, scales));
+        sum = _mm_add_epi32(sum, _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(row + add * 4)),
+                                               _mm_loadu_si128((const __m128i*)(row + sub * 4))));
+    }
+#else
+    int sum[4] = {0, 0, 0, 0};
+    for (int k = -radius; k <= radius; k++)
+    {
+        int x = min(width - 1, max(0, k));
+        for (int c = 0; c < 4; c++)
+        {
+            sum[c] = sum[c] + row[x * 4 + c];
+        }
+    }
+
+    for (int x = 0; x < width; x++)
+    {
+        int add = min(width - 1, x + radius + 1);
+        int sub = max(0, x - radius);
+        for (int c = 0; c < 4; c++)
+        {
+            scratch[x * 4 + c] = box_average(sum[c], scale);
+            sum[c] = sum[c] + (row[add * 4 + c] - row[sub * 4 + c]);
+        }
+    }
+#endif
+    copy(scratch, scratch + width * 4, row);
+}
+
+/**
+ * Gets output row `row` of a chain of vertical box stages. Rows must be asked for in
+ * non-decreasing order; each stage pulls the input rows it needs from the stage before it.
+ * @param stages The chain of stages
+ * @param s      Which stage to get the row from
+ * @param row    The row wanted (clamped to the image by the caller)
+ * @param height Image height in rows
+ * @param source Produces horizontally blurred input row i for the first stage
+ * @return the row, valid until the stage is asked for another one
+ */
+const int* box_stage_row(vector<BoxStage>& stages, int s, int row, int height,
+                         const function<const int*(int)>& source) {
+    BoxStage& stage = stages[s];
+    if (stage.current == row)
+    {
+        return stage.out.data();
+    }
+
+    int ring_size = stage.ring.size();
+    int row_values = stage.sum.size();
+    float scale = 1.0f / (2 * stage.radius + 1);
+
+    // Fetches input row i into the ring, unless it is already there
+    auto input = [&](int i) -> const int* {
+        i = min(height - 1, max(0, i));
+        int slot = i % ring_size;
+        if (stage.ring_row[slot] != i)
+        {
+            const int* values = (s == 0) ? source(i) : box_stage_row(stages, s - 1, i, height, source);
+            copy(values, values + row_values, stage.ring[slot].begin());
+            stage.ring_row[slot] = i;
+        }
+        return stage.ring[slot].data();
+    };
+
+    if (stage.current < 0 || row - stage.current > stage.radius)
+    {
+        // Start a fresh window centered on row
+        fill(stage.sum.begin(), stage.sum.end(), 0);
+        for (int k = -stage.radius; k <= stage.radius; k++)
+        {
+            slide_rows(stage.sum.data(), input(row + k), NULL, stage.out.data(), scale, row_values);
+        }
+    }
+    else
+    {
+        // Slide the window down one row at a time
+        for (int r = stage.current; r < row; r++)
+        {
+            const int* sub = input(r - stage.radius);
+            const int* add = input(r + stage.radius + 1);
+            slide_rows(stage.sum.data(), add, sub, stage.out.data(), scale, row_values);
+        }
+    }
+    stage.current = row;
+    return stage.out.data();
+}
+
+/**
+ * Blurs rows [first, last) of the image into new_image with repeated box passes
+ * in each direction, one strip of BLUR_TILE_COLUMNS columns at a time. Each strip is
+ * blurred horizontally with enough columns either side of it that the result inside
+ * the strip is the same as blurring whole rows. The sums are exact, so the output does
+ * not depend on how the rows are split between threads. Helper function for process_blur().
+ * @param image     The input image
+ * @param new_image Output, already sized like the image
+ * @param radius    Box radius of every pass
+ * @param passes    Number of box passes (1 for a box blur, 3 approximates a Gaussian)
+ * @param first     First row to produce
+ * @param last      One past the last row to produce
+ * @return nothing
+ */
+void blur_rows(const vector<vector<Pixel>>& image, vector<vector<Pixel>>& new_image,
+               int radius, int passes, int first, int last) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    int halo = passes * radius;
+    vector<int> row;
+    vector<int> scratch;
+
+    for (int tile = 0; tile < num_columns; tile = tile + BLUR_TILE_COLUMNS)
+    {
+        int tile_end = min(num_columns, tile + BLUR_TILE_COLUMNS);
+        int row_values = (tile_end - tile) * 4;
+
+        // Each vertical pass needs a ring of 2 * radius + 2 rows of the strip
+        vector<BoxStage> stages(passes);
+        for (int s = 0; s < passes; s++)
+        {
+            stages[s].radius = radius;
+            stages[s].ring.assign(2 * radius + 2, vector<int> (row_values, 0));
+            stages[s].ring_row.assign(2 * radius + 2, -1);
+            stages[s].sum.assign(row_values, 0);
+            stages[s].out.assign(row_values, 0);
+            stages[s].current = -1;
+        }
+
+        // Horizontal passes are done on the strip and its halo as the first stage asks for each row
+        int segment = max(0, tile - halo);
+        int segment_end = min(num_columns, tile_end + halo);
+        row.assign((segment_end - segment) * 4, 0);
+        scratch.assign(row.size(), 0);
+        function<const int*(int)> source = [&](int i) -> const int* {
+            for (int col = segment; col < segment_end; col++)
+            {
+                row[(col - segment) * 4] = image[i][col].blue << BLUR_FRACTION_BITS;
+                row[(col - segment) * 4 + 1] = image[i][col].green << BLUR_FRACTION_BITS;
+                row[(col - segment) * 4 + 2] = image[i][col].red << BLUR_FRACTION_BITS;
+            }
+            for (int p = 0; p < passes; p++)
+            {
+                box_blur_row(row.data(), scratch.data(), segment_end - segment, radius);
+            }
+            return row.data() + (tile - segment) * 4;
+        };
+
+        for (int r = first; r < last; r++)
+        {
+            const int* values = box_stage_row(stages, passes - 1, r, num_rows, source);
+            for (int col = tile; col < tile_end; col++)
+            {
+                new_image[r][col].blue = fixed_to_color(values[(col - tile) * 4]);
+                new_image[r][col].green = fixed_to_color(values[(col - tile) * 4 + 1]);
+                new_image[r][col].red = fixed_to_color(values[(col - tile) * 4 + 2]);
+            }
+        }
+    }
+}
+
+/**
+ * Blurs the image
+ * @param image  The input image to add effect to
+ * @param radius The blur radius in pixels (the standard deviation for the Gaussian)
+ * @param kernel KERNEL_BOX or KERNEL_GAUSSIAN
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_blur(const vector<vector<Pixel>>& image, int radius, int kernel) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    if (radius <= 0)
+    {
+        return image;
+    }
+
+    // Three box passes of this radius have about the variance of the Gaussian
+    int passes = 1;
+    if (kernel == KERNEL_GAUSSIAN)
+    {
+        passes = 3;
+        radius = max(1, (int)round((sqrt(4.0 * radius * radius + 1) - 1) / 2));
+    }
+    radius = min(radius, MAX_BLUR_RADIUS);
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    parallel_rows(num_rows, num_columns * 3, [&](int first, int last) {
+        blur_rows(image, new_image, radius, passes, first, last);
+        return true;
+    });
+    return new_image;
+}
+
+/**
+ * Sharpens the image with an unsharp mask - adds back the difference from a Gaussian blur
+ * @param image  The input image to add effect to
+ * @param radius The blur radius in pixels
+ * @param amount How much of the difference to add back
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_sharpen(const vector<vector<Pixel>>& image, int radius, double amount) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    vector<vector<Pixel>> blurred = process_blur(image, radius, KERNEL_GAUSSIAN);
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        for (int col = 0; col < num_columns; col++)
+        {
+            const Pixel& pixel = image[row][col];
+            const Pixel& blur = blurred[row][col];
+
+            new_image[row][col].red = to_color(pixel.red + amount * (pixel.red - blur.red));
+            new_image[row][col].green = to_color(pixel.green + amount * (pixel.green - blur.green));
+            new_image[row][col].blue = to_color(pixel.blue + amount * (pixel.blue - blur.blue));
+        }
+    }
+
+    return new_image;
+}
+
+/**
+ * Finds edges - gray level is the Sobel gradient strength of the brightness
+ * @param image The input image to add effect to
+ * @return vector of vectors of type Pixel
+ */
+vector<vector<Pixel>> process_edges(const vector<vector<Pixel>>& image) {
+    int num_rows = image.size(); // height
+    int num_columns = image[0].size(); // width
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+
+    parallel_rows(num_rows, num_columns * 3, [&](int first, int last) {
+        // Brightness of three rows at a time, edges repeated
+        vector<vector<int>> gray(3, vector<int> (num_columns + 2));
+        for (int row = first; row < last; row++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                const vector<Pixel>& src = image[min(num_rows - 1, max(0, row + k - 1))];
+                for (int col = 0; col < num_columns + 2; col++)
+                {
+                    const Pixel& pixel = src[min(num_columns - 1, max(0, col - 1))];
+                    gray[k][col] = (pixel.red + pixel.green + pixel.blue) / 3;
+                }
+            }
+
+            for (int col = 0; col < num_columns; col++)
+            {
+                // The Sobel kernels are separable: smooth [1 2 1] one way, difference [-1 0 1] the other
+                int gx = (gray[0][col + 2] - gray[0][col]) + 2 * (gray[1][col + 2] - gray[1][col]) + (gray[2][col + 2] - gray[2][col]);
+                int gy = (gray[2][col] + 2 * gray[2][col + 1] + gray[2][col + 2]) - (gray[0][col] + 2 * gray[0][col + 1] + gray[0][col + 2]);
+                int strength = to_color(sqrt((double)gx * gx + gy * gy) / 4);
+
+                new_image[row][col].red = strength;
+                new_image[row][col].green = strength;
+                new_image[row][col].blue = strength;
+            }
+        }
+        return true;
+    });
+
+    return new_image;
+}
+
+//***************************************************************************************************//
+//                                EXECUTION PLANNER                                                  //
+//***************************************************************************************************//
+
+// Ways to run one of the menu effects, fastest first
+const int PLAN_IN_MEMORY = 0; // Whole input and output images in memory
+const int PLAN_STREAMED = 1;  // Whole input in memory, output written a scanline at a time
+const int PLAN_BANDED = 2;    // Bands of rows read, processed and written in turn
+const int PLAN_TILED = 3;     // Only the source rectangle behind each band of output rows is read
+const char* PLAN_NAMES[] = {"in memory", "streamed", "banded", "tiled"};
+
+// One of the ten menu effects and its parameters
+struct Job
+{
+    int process;           // Menu number of the effect, 1 - 10
+    double scaling_factor; // process_2, process_8 and process_9
+    int rotations;         // process_5
+    int x_scale;           // process_6
+    int y_scale;           // process_6
+    bool keep_alpha;       // Save 32 bit BGRA output keeping the alpha channel of 32 bit input
+};
+
+// How a job will be run
+struct Plan
+{
+    int strategy;          // PLAN_IN_MEMORY, PLAN_STREAMED, PLAN_BANDED or PLAN_TILED
+    int band_rows;         // Output rows per band for banded and tiled plans
+    long long peak_bytes;  // Estimated peak memory
+};
+
+/**
+ * Gets the number of quarter turns process_4 and process_5 make, in Rotate terms
+ * @param job The job
+ * @return 0 - 3, or -1 if the job is not a rotation
+ */
+int job_turns(const Job& job) {
+    if (job.process == 4)
+    {
+        return 1;
+    }
+    if (job.process != 5)
+    {
+        return -1;
+    }
+    int angle = job.rotations * 90;
+    if ((angle%360) == 0)
+    {
+        return 0;
+    }
+    else if ((angle%360) == 90)
+    {
+        return 1;
+    }
+    else if ((angle%360) == 180)
+    {
+        return 2;
+    }
+    return 3;
+}
+
+/**
+ * Gets the bits per pixel the menu saves a job's output with
+ * @param job The job
+ * @return 8 for grayscale, 1 for high contrast, 4 for the five color filter and 24 otherwise
+ */
+int job_bits_per_pixel(const Job& job) {
+    if (job.process == 3)
+    {
+        return 8;
+    }
+    else if (job.process == 7)
+    {
+        return 1;
+    }
+    else if (job.process == 10)
+    {
+        return 4;
+    }
+    return 24;
+}
+
+/**
+ * Gets the fixed palette banded and tiled plans write a job's output with.
+ * 8 bit output always uses the identity gray palette.
+ * @param job The job
+ * @return the packed 0xRRGGBB palette colors, empty for 24 bit output
+ */
+vector<int> job_palette(const Job& job) {
+    vector<int> palette;
+    if (job.process == 3)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            palette.push_back((i << 16) | (i << 8) | i);
+        }
+    }
+    else if (job.process == 7)
+    {
+        palette = {0x000000, 0xFFFFFF};
+    }
+    else if (job.process == 10)
+    {
+        palette = {0x000000, 0xFFFFFF, 0xFF0000, 0x00FF00, 0x0000FF};
+    }
+    return palette;
+}
+
+/**
+ * Gets the size of a job's output image
+ * @param job         The job
+ * @param num_rows    Input height
+ * @param num_columns Input width
+ * @param new_rows    Output, output height
+ * @param new_columns Output, output width
+ * @return nothing
+ */
+void job_output_size(const Job& job, int num_rows, int num_columns, int& new_rows, int& new_columns) {
+    new_rows = num_rows;
+    new_columns = num_columns;
+    if (job_turns(job) % 2 == 1)
+    {
+        new_rows = num_columns;
+        new_columns = num_rows;
+    }
+    else if (job.process == 6)
+    {
+        new_rows = num_rows * job.y_scale;
+        new_columns = num_columns * job.x_scale;
+    }
+}
+
+/**
+ * Estimates the memory a vector of vectors of pixels takes
+ * @param rows    Number of rows
+ * @param columns Number of columns
+ * @return the size in bytes
+ */
+long long image_bytes(long long rows, long long columns) {
+    return rows * (columns * (long long)sizeof(Pixel) + (long long)sizeof(vector<Pixel>));
+}
+
+/**
+ * Estimates the buffers of a parallel_rows() pass over scanlines, up to MAX_CHUNK_BYTES per thread
+ * @param row_bytes Bytes per scanline
+ * @param rows      Number of scanlines
+ * @return the size in bytes
+ */
+long long io_bytes(long long row_bytes, long long rows) {
+    long long threads = thread_count();
+    return min(row_bytes * rows, threads * max(row_bytes, MAX_CHUNK_BYTES));
+}
+
+/**
+ * Works out the source rectangle a tiled plan reads for a band of output rows
+ * @param job         The job
+ * @param num_rows    Input height
+ * @param num_columns Input width
+ * @param band_rows   Output rows per band
+ * @param rect_rows   Output, source rows read per band
+ * @param rect_cols   Output, source columns read per band
+ * @return nothing
+ */
+void tile_rect(const Job& job, int num_rows, int num_columns, int band_rows, int& rect_rows, int& rect_cols) {
+    int turns = job_turns(job);
+    rect_rows = min(num_rows, band_rows);
+    rect_cols = num_columns;
+    if (turns == 1 || turns == 3)
+    {
+        rect_rows = num_rows;
+        rect_cols = min(num_columns, band_rows);
+    }
+    else if (job.process == 6)
+    {
+        rect_rows = min(num_rows, (band_rows + job.y_scale - 1) / job.y_scale + 1);
+    }
+}
+
+/**
+ * Estimates the peak memory of running a job one particular way
+ * @param info      The input image properties
+ * @param job       The job
+ * @param strategy  PLAN_IN_MEMORY, PLAN_STREAMED, PLAN_BANDED or PLAN_TILED
+ * @param band_rows Output rows per band for banded and tiled plans
+ * @return the estimate in bytes
+ */
+long long estimate_peak(const BmpInfo& info, const Job& job, int strategy, int band_rows) {
+    int num_rows = info.height;
+    int num_columns = info.width;
+    int new_rows = 0;
+    int new_columns = 0;
+    job_output_size(job, num_rows, num_columns, new_rows, new_columns);
+    int bits_per_pixel = job_bits_per_pixel(job);
+    long long out_row_bytes = scanline_bytes(new_columns, bits_per_pixel);
+    long long index_row = new_columns + (long long)sizeof(vector<unsigned char>);
+
+    if (strategy == PLAN_IN_MEMORY)
+    {
+        // Input, output, palette indexes and run length encoded output, plus the read and write buffers
+        long long peak = image_bytes(num_rows, num_columns) + image_bytes(new_rows, new_columns);
+        if (bits_per_pixel < 24)
+        {
+            peak = peak + index_row * new_rows + out_row_bytes * new_rows;
+        }
+        if (info.compression == BMP_BI_RLE8 || info.compression == BMP_BI_RLE4)
+        {
+            peak = peak + info.file_size + (num_columns + (long long)sizeof(vector<unsigned char>)) * num_rows;
+        }
+        return peak + io_bytes(info.row_bytes, num_rows) + io_bytes(out_row_bytes, new_rows);
+    }
+    else if (strategy == PLAN_STREAMED)
+    {
+        // Input plus a few rows of 4 floats per pixel and one scanline
+        return image_bytes(num_rows, num_columns) + io_bytes(info.row_bytes, num_rows) +
+               (new_columns * 3LL + num_columns) * 4 * (long long)sizeof(float) + out_row_bytes;
+    }
+    else if (strategy == PLAN_BANDED)
+    {
+        // A band of input and output rows and their scanlines
+        long long peak = image_bytes(band_rows, num_columns) * 2 + (info.row_bytes + out_row_bytes) * band_rows;
+        if (bits_per_pixel < 24)
+        {
+            peak = peak + index_row * band_rows;
+        }
+        return peak;
+    }
+
+    // The source rectangle, a band of output rows and their scanlines
+    int rect_rows = 0;
+    int rect_cols = 0;
+    tile_rect(job, num_rows, num_columns, band_rows, rect_rows, rect_cols);
+    long long threads = thread_count();
+    long long peak = image_bytes(rect_rows, rect_cols) + threads * rect_cols * (info.bits_per_pixel / 8) +
+                     image_bytes(band_rows, new_columns) + out_row_bytes * band_rows;
+    if (bits_per_pixel < 24)
+    {
+        peak = peak + index_row * band_rows;
+    }
+    return peak;
+}
+
+/**
+ * Gets the plan that reads the input file directly for a job, if there is one.
+ * Both read uncompressed scanlines of whole bytes.
+ * @param info The input image properties
+ * @param job  The job
+ * @return PLAN_BANDED for point effects, PLAN_TILED for rotations and enlarge,
+ *         or -1 if the input cannot be read directly
+ */
+int direct_strategy(const BmpInfo& info, const Job& job) {
+    bool compressed = info.compression == BMP_BI_RLE8 || info.compression == BMP_BI_RLE4;
+    if (compressed || info.bits_per_pixel < 8 || (job.keep_alpha && info.bits_per_pixel == 32))
+    {
+        return -1;
+    }
+    if (job.process == 6 || job_turns(job) > 0)
+    {
+        return PLAN_TILED;
+    }
+    return PLAN_BANDED;
+}
+
+/**
+ * Plans a job with a given strategy. Banded and tiled plans get the largest band that fits.
+ * @param info     The input image properties
+ * @param job      The job
+ * @param strategy PLAN_IN_MEMORY, PLAN_STREAMED, PLAN_BANDED or PLAN_TILED
+ * @param budget   Memory budget in bytes
+ * @return the plan, with 1 row per band if even that does not fit
+ */
+Plan plan_bands(const BmpInfo& info, const Job& job, int strategy, long long budget) {
+    int new_rows = 0;
+    int new_columns = 0;
+    job_output_size(job, info.height, info.width, new_rows, new_columns);
+    Plan plan = {strategy, new_rows, estimate_peak(info, job, strategy, new_rows)};
+    if (strategy == PLAN_BANDED || strategy == PLAN_TILED)
+    {
+        // The estimate only grows with the band, so search for the largest band that fits
+        int low = 1;
+        int high = new_rows;
+        while (low < high)
+        {
+            int middle = low + (high - low + 1) / 2;
+            if (estimate_peak(info, job, strategy, middle) <= budget)
+            {
+                low = middle;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+        plan.band_rows = low;
+        plan.peak_bytes = estimate_peak(info, job, strategy, low);
+    }
+    return plan;
+}
+
+/**
+ * Picks the fastest way to run a job whose estimated peak memory fits in the budget.
+ * Banded and tiled plans get the largest bands that fit.
+ * @param info   The input image properties
+ * @param job    The job
+ * @param budget Memory budget in bytes
+ * @return the plan, or the plan with the smallest peak if nothing fits
+ */
+Plan plan_job(const BmpInfo& info, const Job& job, long long budget) {
+    int new_rows = 0;
+    int new_columns = 0;
+    job_output_size(job, info.height, info.width, new_rows, new_columns);
+
+    int direct = direct_strategy(info, job);
+    bool candidates[4] = {true, false, false, false};
+    candidates[PLAN_STREAMED] = job.process == 6;
+    candidates[PLAN_BANDED] = direct == PLAN_BANDED;
+    candidates[PLAN_TILED] = direct == PLAN_TILED;
+
+    Plan smallest = {PLAN_IN_MEMORY, new_rows, estimate_peak(info, job, PLAN_IN_MEMORY, new_rows)};
+    for (int strategy = 0; strategy < 4; strategy++)
+    {
+        if (!candidates[strategy])
+        {
+            continue;
+        }
+
+        Plan plan = plan_bands(info, job, strategy, budget);
+        if (plan.peak_bytes <= budget)
+        {
+            return plan;
+        }
+        if (plan.peak_bytes < smallest.peak_bytes)
+        {
+            smallest = plan;
+        }
+    }
+    return smallest;
+}
+
+/**
+ * Reads a memory limit from a cgroup file
+ * @param path The file
+ * @return the limit in bytes, or -1 if there is no limit or no such file
+ */
+long long read_memory_limit(string path) {
+    ifstream stream(path);
+    string value;
+    if (!(stream >> value) || value == "max")
+    {
+        return -1;
+    }
+    return atoll(value.c_str());
+}
+
+/**
+ * Finds where a cgroup hierarchy is mounted, from /proc/self/mountinfo
+ * @param controller "memory" for the cgroup v1 memory hierarchy, empty for the cgroup v2 hierarchy
+ * @param root       Output, the cgroup the mount shows as its top directory
+ * @return the mount point, or an empty string if it is not mounted
+ */
+string cgroup_mount(string controller, string& root) {
+    ifstream stream("/proc/self/mountinfo");
+    string line;
+    while (getline(stream, line))
+    {
+        // id parent major:minor root mount_point options [optional fields] - type source super_options
+        size_t separator = line.find(" - ");
+        if (separator == string::npos)
+        {
+            continue;
+        }
+        vector<string> fields;
+        vector<string> tail;
+        string field;
+        for (size_t i = 0; i <= separator; i++)
+        {
+            if (i == separator || line[i] == ' ')
+            {
+                fields.push_back(field);
+                field.clear();
+            }
+            else
+            {
+                field.push_back(line[i]);
+            }
+        }
+        for (size_t i = separator + 3; i <= line.size(); i++)
+        {
+            if (i == line.size() || line[i] == ' ')
+            {
+                tail.push_back(field);
+                field.clear();
+            }
+            else
+            {
+                field.push_back(line[i]);
+            }
+        }
+        if (fields.size() < 5 || tail.size() < 3)
+        {
+            continue;
+        }
+
+        bool match = controller.empty() ? tail[0] == "cgroup2" :
+                     tail[0] == "cgroup" && ("," + tail[2] + ",").find("," + controller + ",") != string::npos;
+        if (match)
+        {
+            root = fields[3];
+            return fields[4];
+        }
+    }
+    return "";
+}
+
+/**
+ * Gets the memory limit of the cgroup this process runs in. Reads the process's own
+ * cgroup from /proc/self/cgroup and walks up through its ancestors, since any of them
+ * may hold the limit that applies.
+ * @return the smallest limit in bytes, or -1 if there is none
+ */
+long long cgroup_memory_limit() {
+    ifstream stream("/proc/self/cgroup");
+    string line;
+    long long limit = -1;
+    while (getline(stream, line))
+    {
+        // hierarchy:controllers:path, hierarchy 0 with no controllers is cgroup v2
+        size_t first_colon = line.find(':');
+        size_t second_colon = line.find(':', first_colon + 1);
+        if (first_colon == string::npos || second_colon == string::npos)
+        {
+            continue;
+        }
+        string controllers = line.substr(first_colon + 1, second_colon - first_colon - 1);
+        string path = line.substr(second_colon + 1);
+        string file;
+        string mount;
+        string root;
+        if (controllers.empty() && line.compare(0, first_colon, "0") == 0)
+        {
+            mount = cgroup_mount("", root);
+            file = "memory.max";
+        }
+        else if (("," + controllers + ",").find(",memory,") != string::npos)
+        {
+            mount = cgroup_mount("memory", root);
+            file = "memory.limit_in_bytes";
+        }
+        if (mount.empty())
+        {
+            continue;
+        }
+
+        // Paths are relative to the cgroup the mount shows at its top
+        if (root != "/" && path.compare(0, root.size(), root) == 0)
+        {
+            path = path.substr(root.size());
+        }
+        while (true)
+        {
+            long long value = read_memory_limit(mount + path + "/" + file);
+            if (value > 0 && (limit < 0 || value < limit))
+            {
+                limit = value;
+            }
+            if (path.empty() || path == "/")
+            {
+                break;
+            }
+            path = path.substr(0, path.rfind('/'));
+        }
+    }
+    return limit;
+}
+
+/**
+ * Works out the default memory budget: three quarters of the memory limit of this
+ * process's cgroup, or of the physical memory when there is no limit
+ * @return the budget in bytes
+ */
+long long default_mem_budget() {
+    long long physical = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE);
+    long long limit = cgroup_memory_limit();
+
+    // cgroup v1 reports a huge number when there is no limit
+    if (limit <= 0 || (physical > 0 && limit > physical))
+    {
+        limit = physical;
+    }
+    if (limit <= 0)
+    {
+        limit = 1LL << 30;
+    }
+    return limit / 4 * 3;
+}
+
+/**
+ * Parses a size such as 512M, 2G or 1048576
+ * @param text The size, with an optional K, M or G suffix
+ * @return the size in bytes, or -1 if it is not a valid size
+ */
+long long parse_size(string text) {
+    char* end = NULL;
+    double value = strtod(text.c_str(), &end);
+    string suffix = end;
+    long long unit = 1;
+    if (suffix == "K" || suffix == "k")
+    {
+        unit = 1LL << 10;
+    }
+    else if (suffix == "M" || suffix == "m")
+    {
+        unit = 1LL << 20;
+    }
+    else if (suffix == "G" || suffix == "g")
+    {
+        unit = 1LL << 30;
+    }
+    else if (!suffix.empty())
+    {
+        return -1;
+    }
+    if (end == text.c_str() || value <= 0)
+    {
+        return -1;
+    }
+    return (long long)(value * unit);
+}
+
+/**
+ * Gets the palette index of a pixel for banded and tiled output
+ * @param palette The job palette (256 entries means the identity gray palette)
+ * @param pixel   The pixel
+ * @return the index, 0 if the color is not in the palette
+ */
+int palette_index(const vector<int>& palette, const Pixel& pixel) {
+    if (palette.size() == 256)
+    {
+        return pixel.red & 255;
+    }
+    int color = pack_color(pixel);
+    for (int i = 0; i < (int)palette.size(); i++)
+    {
+        if (palette[i] == color)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Runs a point kernel over an image file band by band, never holding more than
+ * band_rows rows of the input or output. Rows inside a band are split between threads,
+ * each of which reads, processes and writes its own rows.
+ * @param in_fd       The open input BMP
+ * @param in_info     The input image properties
+ * @param in_palette  The input palette for 8 bit images
+ * @param out_fd      The output BMP, already created by create_bmp()
+ * @param out_info    The output image properties
+ * @param out_palette The output palette, empty for 24 bit output
+ * @param kernel      The point kernel
+ * @param band_rows   Rows per band
+ * @param begin       First scanline to run over
+ * @param end         One past the last scanline to run over
+ * @return True if successful and false otherwise
+ */
+template <class Kernel>
+bool run_banded(int in_fd, const BmpInfo& in_info, const vector<Pixel>& in_palette,
+                int out_fd, const BmpInfo& out_info, const vector<int>& out_palette,
+                const Kernel& kernel, int band_rows, int begin, int end) {
+    int num_rows = in_info.height;
+    int num_columns = in_info.width;
+    vector<vector<Pixel>> band(band_rows, vector<Pixel> (num_columns));
+    vector<vector<unsigned char>> indexes;
+    if (!out_palette.empty())
+    {
+        indexes.assign(band_rows, vector<unsigned char> (num_columns));
+    }
+
+    // Scanline 0 is the bottom row of the image, or the top row of a top down input
+    for (int first = begin; first < end; first = first + band_rows)
+    {
+        int count = min(band_rows, end - first);
+        band.resize(count);
+        if (!indexes.empty())
+        {
+            indexes.resize(count);
+        }
+        BmpInfo in_band = in_info;
+        in_band.start = in_info.start + (long long)first * in_info.row_bytes;
+        in_band.height = count;
+        int top_row = in_info.top_down ? first : num_rows - first - count;
+        BmpInfo out_band = out_info;
+        out_band.start = out_info.start + (long long)(num_rows - top_row - count) * out_info.row_bytes;
+        out_band.height = count;
+
+        bool ok = parallel_rows(count, in_info.row_bytes, [&](int begin, int end) {
+            if (!decode_rows(in_fd, in_band, in_palette, band, begin, end, NULL))
+            {
+                return false;
+            }
+            for (int r = begin; r < end; r++)
+            {
+                int b = scanline_row(in_band, r);
+                for (int col = 0; col < num_columns; col++)
+                {
+                    band[b][col] = kernel(band[b][col], top_row + b, col);
+                    if (!indexes.empty())
+                    {
+                        indexes[b][col] = palette_index(out_palette, band[b][col]);
+                    }
+                }
+            }
+            // The output is bottom up, so rows a top down input scanline range holds are reversed
+            if (in_info.top_down)
+            {
+                return encode_rows(out_fd, out_band, band, indexes, count - end, count - begin);
+            }
+            return encode_rows(out_fd, out_band, band, indexes, begin, end);
+        });
+        if (!ok)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads columns [first_col, last_col) of image rows [first, last) of an
+ * uncompressed BMP of 8 or more bits per pixel
+ * Helper function for run_tiled()
+ * @param fd        The open BMP file
+ * @param info      The image properties
+ * @param palette   The palette colors for 8 bit images
+ * @param tile      Output, rows of (last_col - first_col) pixels, row 0 is the top row
+ *                  of the whole rectangle
+ * @param top       Image row of the top row of the tile
+ * @param first_col First column to read
+ * @param last_col  One past the last column to read
+ * @param first     First image row to read
+ * @param last      One past the last image row to read
+ * @return True if the rows were read and false otherwise
+ */
+bool decode_rect(int fd, const BmpInfo& info, const vector<Pixel>& palette, vector<vector<Pixel>>& tile,
+                 int top, int first_col, int last_col, int first, int last) {
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    vector<unsigned char> buffer((long long)(last_col - first_col) * bytes_per_pixel);
+
+    for (int r = first; r < last; r++)
+    {
+        long long scanline = scanline_row(info, r);
+        long long offset = info.start + scanline * info.row_bytes + (long long)first_col * bytes_per_pixel;
+        if (!pread_all(fd, buffer.data(), buffer.size(), offset))
+        {
+            return false;
+        }
+        vector<Pixel>& pixels = tile[r - top];
+        for (int j = 0; j < last_col - first_col; j++)
+        {
+            const unsigned char* pixel = &buffer[j * bytes_per_pixel];
+            if (bytes_per_pixel == 1)
+            {
+                pixels[j] = palette[pixel[0]];
+            }
+            else
+            {
+                pixels[j].blue = pixel[0];
+                pixels[j].green = pixel[1];
+                pixels[j].red = pixel[2];
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs a coordinate map over an image file a band of output rows at a time. Only the
+ * rectangle of source pixels the band needs is read, one partial scanline per source row.
+ * @param in_fd       The open input BMP
+ * @param in_info     The input image properties
+ * @param in_palette  The input palette for 8 bit images
+ * @param out_fd      The output BMP, already created by create_bmp()
+ * @param out_info    The output image properties
+ * @param map         The coordinate map
+ * @param band_rows   Output rows per band
+ * @param begin       First output row to run over
+ * @param end         One past the last output row to run over
+ * @return True if successful and false otherwise
+ */
+template <class Map>
+bool run_tiled(int in_fd, const BmpInfo& in_info, const vector<Pixel>& in_palette,
+               int out_fd, const BmpInfo& out_info, const Map& map, int band_rows, int begin, int end) {
+    int new_rows = out_info.height;
+    int new_columns = out_info.width;
+    vector<vector<Pixel>> band;
+    vector<vector<Pixel>> tile;
+    vector<vector<unsigned char>> no_indexes;
+
+    for (int first = begin; first < end; first = first + band_rows)
+    {
+        int count = min(band_rows, end - first);
+
+        // Bounding rectangle of the source pixels behind these output rows
+        int top = in_info.height;
+        int bottom = -1;
+        int left = in_info.width;
+        int right = -1;
+        for (int row = first; row < first + count; row++)
+        {
+            for (int col = 0; col < new_columns; col++)
+            {
+                int src_row = 0;
+                int src_col = 0;
+                map.source(row, col, src_row, src_col);
+                top = min(top, src_row);
+                bottom = max(bottom, src_row);
+                left = min(left, src_col);
+                right = max(right, src_col);
+            }
+        }
+
+        tile.assign(bottom - top + 1, vector<Pixel> (right - left + 1));
+        bool ok = parallel_rows(bottom - top + 1, (right - left + 1) * 3, [&](int begin, int end) {
+            return decode_rect(in_fd, in_info, in_palette, tile, top, left, right + 1, top + begin, top + end);
+        });
+
+        band.assign(count, vector<Pixel> (new_columns));
+        for (int b = 0; b < count && ok; b++)
+        {
+            for (int col = 0; col < new_columns; col++)
+            {
+                int src_row = 0;
+                int src_col = 0;
+                map.source(first + b, col, src_row, src_col);
+                band[b][col] = tile[src_row - top][src_col - left];
+            }
+        }
+
+        // The band covers file scanlines new_rows - first - count up to new_rows - first
+        BmpInfo out_band = out_info;
+        out_band.start = out_info.start + (long long)(new_rows - first - count) * out_info.row_bytes;
+        out_band.height = count;
+        ok = ok && parallel_rows(count, out_info.row_bytes, [&](int begin, int end) {
+            return encode_rows(out_fd, out_band, band, no_indexes, begin, end);
+        });
+        if (!ok)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 /**
- * Adds vignette effect - dark corners
- * @param image The input image to add effect to
+ * Runs a job on an image already in memory
+ * @param job   The job
+ * @param image The input image
  * @return vector of vectors of type Pixel
  */
-vector<vector<Pixel>> process_1(vector<vector<Pixel>> image) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+vector<vector<Pixel>> run_process(const Job& job, vector<vector<Pixel>> image) {
+    switch (job.process)
+    {
+        case 1: return process_1(move(image));
+        case 2: return process_2(move(image), job.scaling_factor);
+        case 3: return process_3(move(image));
+        case 4: return process_4(move(image));
+        case 5: return process_5(move(image), job.rotations);
+        case 6: return process_6(move(image), job.x_scale, job.y_scale);
+        case 7: return process_7(move(image));
+        case 8: return process_8(move(image), job.scaling_factor);
+        case 9: return process_9(move(image), job.scaling_factor);
+        default: return process_10(move(image));
+    }
+}
 
-    for (int row = 0; row < num_rows; row++)
+/**
+ * Creates the output BMP a banded or tiled plan writes a job's output into
+ * @param output_file The output BMP file name
+ * @param job         The job
+ * @param in_info     The input image properties
+ * @param out_info    Output, the output image properties
+ * @param out_palette Output, the fixed output palette, empty for 24 bit output
+ * @return the open file descriptor, or -1 if the file could not be created
+ */
+int create_job_bmp(string output_file, const Job& job, const BmpInfo& in_info,
+                   BmpInfo& out_info, vector<int>& out_palette) {
+    job_output_size(job, in_info.height, in_info.width, out_info.height, out_info.width);
+    out_info.bits_per_pixel = job_bits_per_pixel(job);
+    out_info.compression = BMP_BI_RGB;
+    out_info.row_bytes = scanline_bytes(out_info.width, out_info.bits_per_pixel);
+    out_palette = job_palette(job);
+    return create_bmp(output_file, out_info, out_palette, out_info.row_bytes * out_info.height);
+}
+
+/**
+ * Runs part of a job with a banded or tiled plan, picking the kernel or map for it
+ * @param job         The job
+ * @param strategy    PLAN_BANDED or PLAN_TILED
+ * @param band_rows   Rows per band
+ * @param in_fd       The open input BMP
+ * @param in_info     The input image properties
+ * @param in_palette  The input palette for 8 bit images
+ * @param out_fd      The output BMP, already created by create_job_bmp()
+ * @param out_info    The output image properties
+ * @param out_palette The output palette, empty for 24 bit output
+ * @param begin       First scanline (banded) or output row (tiled) to run over
+ * @param end         One past the last scanline or output row to run over
+ * @return True if successful and false otherwise
+ */
+bool run_direct(const Job& job, int strategy, int band_rows, int in_fd, const BmpInfo& in_info,
+                const vector<Pixel>& in_palette, int out_fd, const BmpInfo& out_info,
+                const vector<int>& out_palette, int begin, int end) {
+    int num_rows = in_info.height;
+    int num_columns = in_info.width;
+    if (strategy == PLAN_TILED)
     {
-        for (int col = 0; col < num_columns; col++)
+        int turns = job_turns(job);
+        Rotate<1> rotate_1 = {num_rows, num_columns};
+        Rotate<2> rotate_2 = {num_rows, num_columns};
+        Rotate<3> rotate_3 = {num_rows, num_columns};
+        Enlarge enlarge = {job.x_scale, job.y_scale};
+        if (turns == 1)
+        {
+            return run_tiled(in_fd, in_info, in_palette, out_fd, out_info, rotate_1, band_rows, begin, end);
+        }
+        else if (turns == 2)
         {
-            // find the distance to the center
-            double distance = sqrt(pow((col - num_columns/2), 2) + pow((row - num_rows/2),2));
-            double scaling_factor = (num_rows - distance)/num_rows;
+            return run_tiled(in_fd, in_info, in_palette, out_fd, out_info, rotate_2, band_rows, begin, end);
+        }
+        else if (turns == 3)
+        {
+            return run_tiled(in_fd, in_info, in_palette, out_fd, out_info, rotate_3, band_rows, begin, end);
+        }
+        return run_tiled(in_fd, in_info, in_palette, out_fd, out_info, enlarge, band_rows, begin, end);
+    }
+
+    Vignette vignette = {num_rows, num_columns};
+    Clarendon clarendon = {job.scaling_factor, 90, 170};
+    HighContrast high_contrast = high_contrast_kernel(255/2);
+    Lighten lighten = {job.scaling_factor};
+    Darken darken = {job.scaling_factor};
+    switch (job.process)
+    {
+        case 1: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, vignette, band_rows, begin, end);
+        case 2: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, clarendon, band_rows, begin, end);
+        case 3: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, Grayscale(), band_rows, begin, end);
+        case 7: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, high_contrast, band_rows, begin, end);
+        case 8: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, lighten, band_rows, begin, end);
+        case 9: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, darken, band_rows, begin, end);
+        case 10: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, FiveColor(), band_rows, begin, end);
+        default: return run_banded(in_fd, in_info, in_palette, out_fd, out_info, out_palette, Unchanged(), band_rows, begin, end);
+    }
+}
+
+// Shards handed to each worker process, so faster workers pick up more of the image
+const int SHARDS_PER_WORKER = 4;
+
+// MPOL_PREFERRED from <numaif.h>, which is not always installed
+const int NUMA_PREFERRED_POLICY = 1;
+
+// A NUMA node that has CPUs
+struct NumaNode
+{
+    int node;         // Node number
+    vector<int> cpus; // CPUs on the node
+};
 
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+// A range of rows a worker process runs, sent over its socket. begin >= end tells it to stop.
+struct Shard
+{
+    int begin; // First scanline (banded) or output row (tiled)
+    int end;   // One past the last scanline or output row
+};
 
-            int newred = red_color * scaling_factor;
-            int newgreen = green_color * scaling_factor;
-            int newblue = blue_color * scaling_factor;
-            
-            // Set the blue color for the Pixel located at index row, col in a new 2D vector to 50
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].blue = newblue;
+/**
+ * Writes all of a message to a socket, retrying short writes
+ * @param fd     The socket
+ * @param buffer The message
+ * @param bytes  Length of the message
+ * @return True if every byte was written and false otherwise
+ */
+bool send_all(int fd, const void* buffer, long long bytes) {
+    const char* next = (const char*)buffer;
+    while (bytes > 0)
+    {
+        ssize_t count = write(fd, next, bytes);
+        if (count <= 0)
+        {
+            return false;
         }
+        next = next + count;
+        bytes = bytes - count;
     }
+    return true;
+}
 
-    return new_image;
+/**
+ * Reads all of a message from a socket, retrying short reads
+ * @param fd     The socket
+ * @param buffer Where to store the message
+ * @param bytes  Length of the message
+ * @return True if every byte was read and false if the other end closed the socket
+ */
+bool recv_all(int fd, void* buffer, long long bytes) {
+    char* next = (char*)buffer;
+    while (bytes > 0)
+    {
+        ssize_t count = read(fd, next, bytes);
+        if (count <= 0)
+        {
+            return false;
+        }
+        next = next + count;
+        bytes = bytes - count;
+    }
+    return true;
 }
 
 /**
- * Adds clarendon type effect - darks darker and lights lighter
- * @param image The input image to add effect to
- * @param scaling_factor The amount the darks will darken and lights will lighten
- * @return vector of vectors of type Pixel
+ * Parses a Linux CPU or node list such as 0-3,8-11
+ * @param list The list
+ * @return the numbers in the list
  */
-vector<vector<Pixel>> process_2(vector<vector<Pixel>> image, double scaling_factor) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+vector<int> parse_cpu_list(string list) {
+    vector<int> numbers;
+    size_t position = 0;
+    while (position < list.size())
+    {
+        size_t comma = list.find(',', position);
+        if (comma == string::npos)
+        {
+            comma = list.size();
+        }
+        string range = list.substr(position, comma - position);
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+        for (int number = first; number <= last; number++)
+        {
+            numbers.push_back(number);
+        }
+        position = comma + 1;
+    }
+    return numbers;
+}
 
-    for (int row = 0; row < num_rows; row++)
+/**
+ * Gets the online NUMA nodes that have CPUs, from /sys/devices/system/node. Node numbers
+ * may have gaps, and nodes with only memory are left out since nothing can be pinned to them.
+ * @return the nodes, empty if the machine does not report any
+ */
+vector<NumaNode> numa_nodes() {
+    vector<NumaNode> nodes;
+    ifstream online("/sys/devices/system/node/online");
+    string list;
+    if (!(online >> list))
     {
-        for (int col = 0; col < num_columns; col++)
+        return nodes;
+    }
+
+    vector<int> numbers = parse_cpu_list(list);
+    for (int i = 0; i < (int)numbers.size(); i++)
+    {
+        ifstream stream("/sys/devices/system/node/node" + to_string(numbers[i]) + "/cpulist");
+        string cpus;
+        if (stream >> cpus)
+        {
+            NumaNode node = {numbers[i], parse_cpu_list(cpus)};
+            nodes.push_back(node);
+        }
+    }
+    return nodes;
+}
+
+/**
+ * Pins the calling process to the CPUs of a NUMA node and prefers that node's memory
+ * for its allocations. Does nothing outside Linux.
+ * @param node The node
+ * @return True if the process was pinned and its memory policy set, false otherwise
+ */
+bool pin_to_node(const NumaNode& node) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < (int)node.cpus.size(); i++)
+    {
+        if (node.cpus[i] < CPU_SETSIZE)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+            CPU_SET(node.cpus[i], &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        return false;
+    }
 
-            int average_color_value = (red_color + green_color + blue_color)/3;
+    // The preferred node is a bit mask of as many longs as it takes. The kernel reads one bit
+    // fewer than the maximum node it is given, hence the + 1.
+    const int MASK_BITS = sizeof(unsigned long) * 8;
+    vector<unsigned long> mask(node.node / MASK_BITS + 1, 0);
+    mask[node.node / MASK_BITS] = 1UL << (node.node % MASK_BITS);
+    return syscall(SYS_set_mempolicy, NUMA_PREFERRED_POLICY, mask.data(), mask.size() * MASK_BITS + 1) == 0;
+#else
+    (void)node;
+    return false;
+#endif
+}
+
+/**
+ * Runs shards of a job as they arrive on a socket until told to stop, answering each with
+ * a byte that is 1 if it succeeded. Runs in a worker process started by run_sharded().
+ * @param socket      The worker's end of its socket
+ * @param job         The job
+ * @param strategy    PLAN_BANDED or PLAN_TILED
+ * @param band_rows   Rows per band
+ * @param in_fd       The open input BMP
+ * @param in_info     The input image properties
+ * @param in_palette  The input palette for 8 bit images
+ * @param out_fd      The output BMP, already created by create_job_bmp()
+ * @param out_info    The output image properties
+ * @param out_palette The output palette, empty for 24 bit output
+ * @return nothing
+ */
+void run_worker(int socket, const Job& job, int strategy, int band_rows, int in_fd, const BmpInfo& in_info,
+                const vector<Pixel>& in_palette, int out_fd, const BmpInfo& out_info,
+                const vector<int>& out_palette) {
+    Shard shard;
+    while (recv_all(socket, &shard, sizeof(shard)) && shard.begin < shard.end)
+    {
+        char ok = run_direct(job, strategy, band_rows, in_fd, in_info, in_palette,
+                             out_fd, out_info, out_palette, shard.begin, shard.end);
+        if (!send_all(socket, &ok, 1))
+        {
+            break;
+        }
+    }
+}
 
-            int newred = 0;
-            int newgreen = 0;
-            int newblue = 0;
+/**
+ * Runs a job with a banded or tiled plan split between local worker processes. The
+ * coordinator hands out shards of rows over a Unix socket per worker, next shard to whichever
+ * worker finishes first. Workers write their rows straight into the output file at their
+ * scanline offsets, so there is nothing to stitch afterwards. Worker i is pinned to NUMA
+ * node i modulo the number of nodes and splits the hardware threads with the other workers.
+ * @param output_file The output BMP file name
+ * @param job         The job
+ * @param budget      Memory budget in bytes, split evenly between the workers
+ * @param workers     Number of worker processes
+ * @param in_fd       The open input BMP
+ * @param in_info     The input image properties
+ * @param in_palette  The input palette for 8 bit images
+ * @return True if successful and false otherwise
+ */
+bool run_sharded(string output_file, const Job& job, long long budget, int workers,
+                 int in_fd, const BmpInfo& in_info, const vector<Pixel>& in_palette) {
+    int strategy = direct_strategy(in_info, job);
+    Plan plan = plan_bands(in_info, job, strategy, budget / workers);
+    BmpInfo out_info;
+    vector<int> out_palette;
+    int out_fd = create_job_bmp(output_file, job, in_info, out_info, out_palette);
+    if (out_fd < 0)
+    {
+        return false;
+    }
 
-            if (average_color_value >= 170)
+    int rows = strategy == PLAN_BANDED ? in_info.height : out_info.height;
+    workers = min(workers, rows);
+    int shards = min(rows, workers * SHARDS_PER_WORKER);
+    if (plan.band_rows > (rows + shards - 1) / shards)
+    {
+        plan.band_rows = (rows + shards - 1) / shards;
+        plan.peak_bytes = estimate_peak(in_info, job, strategy, plan.band_rows);
+    }
+    vector<NumaNode> nodes = numa_nodes();
+    cout << "Plan: " << PLAN_NAMES[strategy] << " in " << workers << " worker processes, "
+         << shards << " shards, " << plan.band_rows << " rows per band, estimated peak "
+         << plan.peak_bytes / 1048576.0 << " MB per worker of " << budget / 1048576.0 << " MB budget"
+         << (plan.peak_bytes * workers > budget ? " (over budget)" : "") << endl;
+    if (nodes.size() > 1)
+    {
+        cout << "Pinning workers across " << nodes.size() << " NUMA nodes" << endl;
+    }
+    cout.flush();
+
+    // Start the workers, each with its own socket
+    vector<int> sockets;
+    vector<pid_t> pids;
+    unsigned int worker_threads = max(1LL, thread_count() / workers);
+    bool ok = true;
+    for (int w = 0; w < workers && ok; w++)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+        {
+            ok = false;
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            for (int i = 0; i < (int)sockets.size(); i++)
             {
-                newred = int(255 - (255 - red_color)*scaling_factor);
-                newgreen = int(255 - (255 - green_color)*scaling_factor);
-                newblue =  int(255 - (255 - blue_color)*scaling_factor);
-            } 
-            else if (average_color_value < 90)
+                close(sockets[i]);
+            }
+            close(pair[0]);
+            const NumaNode* node = nodes.size() > 1 ? &nodes[w % nodes.size()] : NULL;
+            if (node != NULL && !pin_to_node(*node))
             {
-                newred = red_color * scaling_factor;
-                newgreen = green_color * scaling_factor;
-                newblue = blue_color * scaling_factor;
+                cout << "Could not pin worker " << w << " to NUMA node " << node->node << endl;
             }
-            else
+            max_threads = worker_threads;
+            run_worker(pair[1], job, strategy, plan.band_rows, in_fd, in_info, in_palette,
+                       out_fd, out_info, out_palette);
+            _exit(0);
+        }
+        close(pair[1]);
+        if (pid < 0)
+        {
+            close(pair[0]);
+            ok = false;
+            break;
+        }
+        sockets.push_back(pair[0]);
+        pids.push_back(pid);
+    }
+
+    // Hand out shards until every one has been run, or one fails
+    int next = 0;
+    int running = 0;
+    for (int w = 0; w < (int)sockets.size() && ok && next < shards; w++)
+    {
+        Shard shard = {(int)((long long)rows * next / shards), (int)((long long)rows * (next + 1) / shards)};
+        ok = send_all(sockets[w], &shard, sizeof(shard));
+        next++;
+        running++;
+    }
+    vector<pollfd> polls(sockets.size());
+    for (int w = 0; w < (int)sockets.size(); w++)
+    {
+        polls[w].fd = sockets[w];
+        polls[w].events = POLLIN;
+    }
+    while (ok && running > 0)
+    {
+        if (poll(polls.data(), polls.size(), -1) < 0)
+        {
+            ok = false;
+            break;
+        }
+        for (int w = 0; w < (int)polls.size() && ok; w++)
+        {
+            if (polls[w].revents == 0)
+            {
+                continue;
+            }
+            char done = 0;
+            ok = recv_all(sockets[w], &done, 1) && done;
+            running--;
+            if (ok && next < shards)
             {
-                newred = red_color;
-                newgreen = green_color;
-                newblue = blue_color;
+                Shard shard = {(int)((long long)rows * next / shards), (int)((long long)rows * (next + 1) / shards)};
+                ok = send_all(sockets[w], &shard, sizeof(shard));
+                next++;
+                running++;
             }
-            
-            // Set the blue color for the Pixel located at index row, col in a new 2D vector to 50
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].blue = newblue;
         }
     }
 
-    return new_image;
+    // Closing a socket tells its worker to stop
+    for (int w = 0; w < (int)sockets.size(); w++)
+    {
+        close(sockets[w]);
+    }
+    for (int w = 0; w < (int)pids.size(); w++)
+    {
+        int status = 0;
+        ok = waitpid(pids[w], &status, 0) == pids[w] && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+    }
+    return close(out_fd) == 0 && ok;
 }
 
+// Bump when a change to an effect changes its output, so older cache entries are never used
+const unsigned long long CACHE_VERSION = 2;
+
+// Pixel arrays are hashed in blocks of this size, one thread per run of blocks
+const long long HASH_BLOCK_BYTES = MAX_CHUNK_BYTES;
+
+// Default size limit of the result cache
+const long long DEFAULT_CACHE_BYTES = 1LL << 30;
+
+// XXH64 primes
+const unsigned long long HASH_PRIME_1 = 11400714785074694791ULL;
+const unsigned long long HASH_PRIME_2 = 14029467366897019727ULL;
+const unsigned long long HASH_PRIME_3 = 1609587929392839161ULL;
+const unsigned long long HASH_PRIME_4 = 9650029242287828579ULL;
+const unsigned long long HASH_PRIME_5 = 2870177450012600261ULL;
+
+// An on-disk cache of effect outputs keyed by input pixels and effect parameters
+struct ResultCache
+{
+    string dir;          // Directory of cached BMPs, empty if the cache is off
+    long long max_bytes; // Size limit, least recently used entries are evicted past it
+};
+
 /**
- * Greyscale the image
- * @param image The input image to add effect to
- * @return vector of vectors of type Pixel
+ * Rotates a 64 bit value left
+ * @param value The value
+ * @param bits  Number of bits to rotate by, 1 - 63
+ * @return the rotated value
  */
-vector<vector<Pixel>> process_3(vector<vector<Pixel>> image) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+unsigned long long rotate_left(unsigned long long value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
 
-    for (int row = 0; row < num_rows; row++)
+/**
+ * Reads 8 or 4 little endian bytes
+ * Helper function for hash_bytes()
+ * @param data  The bytes
+ * @param bytes 8 or 4
+ * @return the value
+ */
+unsigned long long read_word(const unsigned char* data, int bytes) {
+    unsigned long long value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
     {
-        for (int col = 0; col < num_columns; col++)
-        {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            int gray_value = (red_color + green_color + blue_color)/3;
-            
-            new_image[row][col].red = gray_value;
-            new_image[row][col].green = gray_value;
-            new_image[row][col].blue = gray_value;
-        }
+        value = (value << 8) | data[i];
     }
-
-    return new_image;
+    return value;
 }
 
 /**
- * Rotates by 180 degrees
- * @param image The input image to add effect to
- * @return vector of vectors of type Pixel
+ * Mixes 8 bytes into one of the four XXH64 accumulators
+ * Helper function for hash_bytes()
+ * @param accumulator The accumulator
+ * @param word        The 8 bytes
+ * @return the new accumulator
  */
-vector<vector<Pixel>> process_rotate_180(vector<vector<Pixel>> image) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+unsigned long long hash_round(unsigned long long accumulator, unsigned long long word) {
+    accumulator = accumulator + word * HASH_PRIME_2;
+    return rotate_left(accumulator, 31) * HASH_PRIME_1;
+}
 
-    for (int row = 0; row < num_rows; row++)
+/**
+ * Hashes bytes with XXH64, which runs at memory speed
+ * @param data  The bytes
+ * @param bytes Number of bytes
+ * @param seed  Seed of the hash
+ * @return the 64 bit hash
+ */
+unsigned long long hash_bytes(const unsigned char* data, long long bytes, unsigned long long seed) {
+    const unsigned char* end = data + bytes;
+    unsigned long long hash = 0;
+    if (bytes >= 32)
     {
-        for (int col = 0; col < num_columns; col++)
+        unsigned long long lanes[4] = {seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1};
+        for (; data + 32 <= end; data = data + 32)
         {
-            int red_color = image[num_rows - row - 1][col].red;
-            int green_color = image[num_rows - row - 1][col].green;
-            int blue_color = image[num_rows - row - 1][col].blue;
-
-            new_image[row][col].red = red_color;
-            new_image[row][col].green = green_color;
-            new_image[row][col].blue = blue_color;
+            for (int lane = 0; lane < 4; lane++)
+            {
+                lanes[lane] = hash_round(lanes[lane], read_word(data + lane * 8, 8));
+            }
+        }
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            hash = (hash ^ hash_round(0, lanes[lane])) * HASH_PRIME_1 + HASH_PRIME_4;
         }
     }
+    else
+    {
+        hash = seed + HASH_PRIME_5;
+    }
+    hash = hash + bytes;
 
-    return new_image;
+    // Up to 31 bytes left over
+    for (; data + 8 <= end; data = data + 8)
+    {
+        hash = rotate_left(hash ^ hash_round(0, read_word(data, 8)), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if (data + 4 <= end)
+    {
+        hash = rotate_left(hash ^ (read_word(data, 4) * HASH_PRIME_1), 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        data = data + 4;
+    }
+    for (; data < end; data++)
+    {
+        hash = rotate_left(hash ^ (*data * HASH_PRIME_5), 11) * HASH_PRIME_1;
+    }
+
+    hash = (hash ^ (hash >> 33)) * HASH_PRIME_2;
+    hash = (hash ^ (hash >> 29)) * HASH_PRIME_3;
+    return hash ^ (hash >> 32);
 }
 
 /**
- * Rotates by 270 degrees
- * @param image The input image to add effect to
- * @return vector of vectors of type Pixel
+ * Appends a value to the bytes a cache key is hashed from
+ * Helper function for cache_key()
+ * @param key   The key bytes
+ * @param value The value
+ * @param bytes Number of low bytes of the value to append
+ * @return nothing
  */
-vector<vector<Pixel>> process_rotate_270(vector<vector<Pixel>> image) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    int new_rows = num_columns;
-    int new_columns = num_rows;
-    vector<vector<Pixel>> new_image(new_rows, vector<Pixel> (new_columns));
-    vector<vector<Pixel>> new_image2(new_rows, vector<Pixel> (new_columns));
-
-    for (int row = 0; row < new_rows; row++)
+void add_key_bytes(vector<unsigned char>& key, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++)
     {
-        for (int col = 0; col < new_columns; col++)
-        {
-            int red_color = image[col][row].red;
-            int green_color = image[col][row].green;
-            int blue_color = image[col][row].blue;
+        key.push_back((value >> (i * 8)) & 255);
+    }
+}
 
-            new_image[row][col].red = red_color;
-            new_image[row][col].green = green_color;
-            new_image[row][col].blue = blue_color;
+/**
+ * Works out the cache key of running a job on an input file. The key covers the raw pixel
+ * array as stored in the file, so the input is hashed without being decoded, along with the
+ * image size, format and palette, and the effect and its parameters.
+ * @param in_fd      The open input BMP
+ * @param in_info    The input image properties
+ * @param in_palette The input palette
+ * @param job        The job
+ * @return the key as 16 hex digits, or an empty string if the input could not be read
+ */
+string cache_key(int in_fd, const BmpInfo& in_info, const vector<Pixel>& in_palette, const Job& job) {
+    // Hash fixed size blocks of the pixel array in parallel, so the key does not depend on the thread count
+    long long array_bytes = in_info.file_size - in_info.start;
+    int blocks = (array_bytes + HASH_BLOCK_BYTES - 1) / HASH_BLOCK_BYTES;
+    vector<unsigned long long> block_hashes(blocks);
+    bool ok = parallel_rows(blocks, HASH_BLOCK_BYTES, [&](int first, int last) {
+        vector<unsigned char> buffer(min(array_bytes, HASH_BLOCK_BYTES));
+        for (int block = first; block < last; block++)
+        {
+            long long offset = block * HASH_BLOCK_BYTES;
+            long long bytes = min(HASH_BLOCK_BYTES, array_bytes - offset);
+            if (!pread_all(in_fd, buffer.data(), bytes, in_info.start + offset))
+            {
+                return false;
+            }
+            block_hashes[block] = hash_bytes(buffer.data(), bytes, block);
         }
+        return true;
+    });
+    if (!ok)
+    {
+        return "";
     }
 
-    return new_image;
-}
+    vector<unsigned char> key;
+    add_key_bytes(key, in_info.width, 4);
+    add_key_bytes(key, in_info.height, 4);
+    add_key_bytes(key, in_info.bits_per_pixel, 4);
+    add_key_bytes(key, in_info.compression, 4);
+    add_key_bytes(key, in_info.top_down, 1);
+    for (int i = 0; i < (int)in_palette.size(); i++)
+    {
+        add_key_bytes(key, pack_color(in_palette[i]), 3);
+    }
+    for (int block = 0; block < blocks; block++)
+    {
+        add_key_bytes(key, block_hashes[block], 8);
+    }
 
-vector<vector<Pixel>> process_reflect_image(vector<vector<Pixel>> image) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    // The effect and all of its parameters, the scaling factor bit for bit
+    unsigned long long scaling_factor = 0;
+    memcpy(&scaling_factor, &job.scaling_factor, sizeof(job.scaling_factor));
+    add_key_bytes(key, job.process, 4);
+    add_key_bytes(key, scaling_factor, 8);
+    add_key_bytes(key, job.rotations, 4);
+    add_key_bytes(key, job.x_scale, 4);
+    add_key_bytes(key, job.y_scale, 4);
+    add_key_bytes(key, job.keep_alpha, 1);
+
+    unsigned long long hash = hash_bytes(key.data(), key.size(), CACHE_VERSION);
+    const char* digits = "0123456789abcdef";
+    string hex;
+    for (int shift = 60; shift >= 0; shift = shift - 4)
+    {
+        hex.push_back(digits[(hash >> shift) & 15]);
+    }
+    return hex;
+}
 
-    for (int row = 0; row < num_rows; row++)
+/**
+ * Copies a file, as a copy on write clone where the file system supports it. The copy is
+ * written under a temporary name and renamed into place, so no one sees a partial file.
+ * @param from The file to copy
+ * @param to   The new file
+ * @param mode Permissions of the new file
+ * @return True if successful and false otherwise
+ */
+bool copy_file(string from, string to, mode_t mode) {
+    int in_fd = open(from.c_str(), O_RDONLY);
+    struct stat in_stat;
+    if (in_fd < 0 || fstat(in_fd, &in_stat) != 0)
     {
-        for (int col = 0; col < num_columns; col++)
+        if (in_fd >= 0)
         {
+            close(in_fd);
+        }
+        return false;
+    }
+    string temporary = to + "." + to_string(getpid()) + ".tmp";
+    int out_fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = out_fd >= 0;
+#ifdef FICLONE
+    bool cloned = ok && ioctl(out_fd, FICLONE, in_fd) == 0;
+#else
+    bool cloned = false;
+#endif
+    if (ok && !cloned)
+    {
+        vector<unsigned char> buffer(min((long long)in_stat.st_size, MAX_CHUNK_BYTES));
+        for (long long offset = 0; offset < in_stat.st_size && ok; offset = offset + MAX_CHUNK_BYTES)
+        {
+            long long bytes = min(MAX_CHUNK_BYTES, in_stat.st_size - offset);
+            ok = pread_all(in_fd, buffer.data(), bytes, offset) && pwrite_all(out_fd, buffer.data(), bytes, offset);
+        }
+    }
+    close(in_fd);
+    ok = out_fd >= 0 && fchmod(out_fd, mode) == 0 && close(out_fd) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), to.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
 
-            int red_color = image[row][num_columns - col].red;
-            int green_color = image[row][num_columns - col].green;
-            int blue_color = image[row][num_columns - col].blue;
-
-            new_image[row][col].red = red_color;
-            new_image[row][col].green = green_color;
-            new_image[row][col].blue = blue_color;
+/**
+ * Counts a cache lookup in the hit and miss totals kept in the cache directory, and logs them.
+ * The file is locked while it is updated, so jobs running at the same time all get counted.
+ * @param cache The cache
+ * @param hit   True for a hit and false for a miss
+ * @return nothing
+ */
+void count_cache_lookup(const ResultCache& cache, bool hit) {
+    string path = cache.dir + "/stats.txt";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
         }
+        return;
+    }
+
+    char text[64] = {0};
+    long long hits = 0;
+    long long misses = 0;
+    if (pread(fd, text, sizeof(text) - 1, 0) > 0)
+    {
+        char* end = NULL;
+        hits = strtoll(text, &end, 10);
+        misses = strtoll(end, NULL, 10);
+    }
+    if (hit)
+    {
+        hits++;
+    }
+    else
+    {
+        misses++;
+    }
+    string counts = to_string(hits) + " " + to_string(misses) + "\n";
+    if (ftruncate(fd, 0) == 0)
+    {
+        pwrite_all(fd, (const unsigned char*)counts.data(), counts.size(), 0);
     }
+    flock(fd, LOCK_UN);
+    close(fd);
 
-    return new_image;
+    cout << "Cache " << (hit ? "hit" : "miss") << ", " << hits << " hits and " << misses
+         << " misses (" << 100.0 * hits / (hits + misses) << "% hit rate)" << endl;
 }
 
 /**
- * Rotates by 90 degrees
- * @param image The input image to add effect to
- * @return vector of vectors of type Pixel
+ * Looks up a cached output. A hit is cloned or copied to the output file name, so the
+ * output never shares its data with the cache entry, and the entry is marked as just used.
+ * @param cache       The cache
+ * @param key         The cache key
+ * @param output_file The output BMP file name
+ * @return True on a hit and false on a miss
  */
-vector<vector<Pixel>> process_4(vector<vector<Pixel>> image) {
-    vector<vector<Pixel>> img_process_rotate_270 = process_rotate_270(image);
-    vector<vector<Pixel>> img_process_4 = process_reflect_image(img_process_rotate_270);
-    return img_process_4;
+bool cache_lookup(const ResultCache& cache, string key, string output_file) {
+    string entry = cache.dir + "/" + key + ".bmp";
+    bool hit = access(entry.c_str(), R_OK) == 0 && copy_file(entry, output_file, 0644);
+    if (hit)
+    {
+        // The modification time orders entries for eviction
+        utimes(entry.c_str(), NULL);
+    }
+    count_cache_lookup(cache, hit);
+    return hit;
 }
 
 /**
- * Rotates by multiples of 90 degrees
- * @param image The input image to add effect to
- * @param rotations The number of times to rotate the image
- * @return vector of vectors of type Pixel
+ * Evicts the least recently used cache entries until the cache fits its size limit
+ * @param cache The cache
+ * @return nothing
  */
-vector<vector<Pixel>> process_5(vector<vector<Pixel>> image, int rotations) {
-    int angle = rotations * 90;
-    if (angle%90 != 0)
+void evict_cache(const ResultCache& cache) {
+    DIR* dir = opendir(cache.dir.c_str());
+    if (dir == NULL)
     {
-        cout << "Angle must be a multiple of 90 degrees.";
-        return image;
+        return;
     }
-    else if ((angle%360) == 0)
+
+    // Entries by last use to the nanosecond, oldest first
+    vector<pair<pair<long long, long long>, string>> entries;
+    long long total = 0;
+    for (dirent* item = readdir(dir); item != NULL; item = readdir(dir))
     {
-        return image;
+        string name = item->d_name;
+        struct stat entry_stat;
+        string path = cache.dir + "/" + name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bmp") == 0 && stat(path.c_str(), &entry_stat) == 0)
+        {
+#ifdef __APPLE__
+            timespec used = entry_stat.st_mtimespec;
+#else
+            timespec used = entry_stat.st_mtim;
+#endif
+            entries.push_back(make_pair(make_pair((long long)used.tv_sec, (long long)used.tv_nsec), path));
+            total = total + entry_stat.st_size;
+        }
     }
-    else if ((angle%360) == 90)
-    {
-        vector<vector<Pixel>> final_image = process_4(image);
-        return final_image;
+    closedir(dir);
+    sort(entries.begin(), entries.end());
 
-    }
-    else if ((angle%360) == 180)
+    for (int i = 0; i < (int)entries.size() && total > cache.max_bytes; i++)
     {
-        vector<vector<Pixel>> image_180 = process_rotate_180(image);
-        vector<vector<Pixel>> final_image = process_reflect_image(image_180);
-        return final_image;
-    }
-    else {
-        vector<vector<Pixel>> final_image = process_rotate_270(image);
-        return final_image;
+        struct stat entry_stat;
+        if (stat(entries[i].second.c_str(), &entry_stat) == 0 && unlink(entries[i].second.c_str()) == 0)
+        {
+            total = total - entry_stat.st_size;
+        }
     }
 }
 
 /**
- * Enlarges in the x and y direction
- * @param image The input image to add effect to
- * @param x The amount to grow the image horizontally
- * @param y The amount to grow the image vertically
- * @return vector of vectors of type Pixel
+ * Stores a read only clone or copy of a job's output in the cache, then evicts old entries
+ * @param cache       The cache
+ * @param key         The cache key
+ * @param output_file The output BMP file name
+ * @return nothing
  */
-vector<vector<Pixel>> process_6(vector<vector<Pixel>> image, int x, int y) {
-    int num_rows = image.size(); // height
-    int new_rows = num_rows * y;
-    int num_columns = image[0].size(); // width
-    int new_columns = num_columns * x; // width
-    vector<vector<Pixel>> new_image(new_rows, vector<Pixel> (new_columns));
-
-    for (int row = 0; row < new_rows; row++)
+void cache_store(const ResultCache& cache, string key, string output_file) {
+    string entry = cache.dir + "/" + key + ".bmp";
+    if (!copy_file(output_file, entry, 0444))
     {
-        for (int col = 0; col < new_columns; col++)
-        {
-            int colx = col/x;
-            int rowy = row/y;
-
-            int red_color = image[rowy][colx].red;
-            int green_color = image[rowy][colx].green;
-            int blue_color = image[rowy][colx].blue;
-
-            new_image[row][col].red = red_color;
-            new_image[row][col].green = green_color;
-            new_image[row][col].blue = blue_color;
-        }
+        cout << "Could not store " << output_file << " in the cache" << endl;
     }
-
-    return new_image;
+    evict_cache(cache);
 }
 
 /**
- * Converts image to high contrast - black and white only
- * @param image The input image to add effect to
- * @return vector of vectors of type Pixel
+ * Runs a job in memory on a 32 bit image, carrying its alpha channel through to 32 bit BGRA
+ * output. Rotations and enlarge move the alpha with the pixels, other effects leave it as is.
+ * Helper function for run_planned()
+ * @param input_file  The input BMP file name
+ * @param output_file The output BMP file name
+ * @param job         The job
+ * @return True if successful and false otherwise
  */
-vector<vector<Pixel>> process_7(vector<vector<Pixel>> image) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+bool run_with_alpha(string input_file, string output_file, const Job& job) {
+    vector<vector<unsigned char>> alpha;
+    vector<vector<Pixel>> img = read_bmp(input_file, NULL, &alpha);
+    if (img.empty())
+    {
+        return false;
+    }
+    vector<vector<Pixel>> new_img = run_process(job, move(img));
+    if (alpha.empty())
+    {
+        // No alpha channel after all
+        int bits_per_pixel = job_bits_per_pixel(job);
+        return write_bmp(output_file, new_img, bits_per_pixel, bits_per_pixel == 4 || bits_per_pixel == 8);
+    }
+    cout << "Plan: in memory, keeping alpha" << endl;
 
-    for (int row = 0; row < num_rows; row++)
+    if (job.process == 4 || job.process == 5 || job.process == 6)
     {
-        for (int col = 0; col < num_columns; col++)
+        // These only move pixels, so run them on the alpha values stored as pixels
+        vector<vector<Pixel>> alpha_img(alpha.size(), vector<Pixel> (alpha[0].size()));
+        for (int row = 0; row < (int)alpha.size(); row++)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            int gray_value = (red_color + green_color + blue_color)/3;
-
-            int newred = 0;
-            int newgreen = 0;
-            int newblue = 0;
-
-            if (gray_value >= 255/2)
+            for (int col = 0; col < (int)alpha[row].size(); col++)
+            {
+                alpha_img[row][col] = Pixel {alpha[row][col], 0, 0};
+            }
+        }
+        alpha_img = run_process(job, move(alpha_img));
+        alpha.assign(alpha_img.size(), vector<unsigned char> (alpha_img[0].size()));
+        for (int row = 0; row < (int)alpha.size(); row++)
+        {
+            for (int col = 0; col < (int)alpha[row].size(); col++)
             {
-                newred = 255;
-                newgreen = 255;
-                newblue = 255;
+                alpha[row][col] = alpha_img[row][col].red;
             }
-            
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].blue = newblue;
         }
     }
-
-    return new_image;
+    return write_bmp(output_file, new_img, 32, false, &alpha);
 }
 
 /**
- * Lightens image
- * @param image The input image to add effect to
- * @param scaling_factor The degree the image should be lightened
- * @return vector of vectors of type Pixel
+ * Plans and runs one of the ten menu effects within a memory budget, logging the plan
+ * Helper function for run_job()
+ * @param input_file  The input BMP file name
+ * @param output_file The output BMP file name
+ * @param job         The job
+ * @param budget      Memory budget in bytes
+ * @param workers     Worker processes to split banded and tiled plans between, 1 for none
+ * @param in_fd       The open input BMP
+ * @param in_info     The input image properties
+ * @param in_palette  The input palette for 8 bit images
+ * @return True if successful and false otherwise
  */
-vector<vector<Pixel>> process_8(vector<vector<Pixel>> image, double scaling_factor) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+bool run_planned(string input_file, string output_file, const Job& job, long long budget, int workers,
+                 int in_fd, const BmpInfo& in_info, const vector<Pixel>& in_palette) {
+    if (job.keep_alpha && in_info.bits_per_pixel == 32)
+    {
+        return run_with_alpha(input_file, output_file, job);
+    }
+    if (workers > 1 && direct_strategy(in_info, job) >= 0)
+    {
+        return run_sharded(output_file, job, budget, workers, in_fd, in_info, in_palette);
+    }
 
-    for (int row = 0; row < num_rows; row++)
+    Plan plan = plan_job(in_info, job, budget);
+    cout << "Plan: " << PLAN_NAMES[plan.strategy];
+    if (plan.strategy == PLAN_BANDED || plan.strategy == PLAN_TILED)
     {
-        for (int col = 0; col < num_columns; col++)
-        {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
+        cout << ", " << plan.band_rows << " rows per band";
+    }
+    cout << ", estimated peak " << plan.peak_bytes / 1048576.0 << " MB of "
+         << budget / 1048576.0 << " MB budget" << (plan.peak_bytes > budget ? " (over budget)" : "") << endl;
 
-            int newred = 255 - (255 - red_color) * scaling_factor;
-            int newgreen = 255 - (255 - green_color) * scaling_factor;
-            int newblue = 255 - (255 - blue_color) * scaling_factor;
-            
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].blue = newblue;
+    if (plan.strategy == PLAN_IN_MEMORY || plan.strategy == PLAN_STREAMED)
+    {
+        vector<vector<Pixel>> img = read_bmp(input_file);
+        if (img.empty())
+        {
+            return false;
+        }
+        if (plan.strategy == PLAN_STREAMED)
+        {
+            int new_width = img[0].size() * job.x_scale;
+            int new_height = img.size() * job.y_scale;
+            return resample_to_file(output_file, img, new_width, new_height, RESAMPLE_NEAREST);
         }
+        vector<vector<Pixel>> new_img = run_process(job, move(img));
+        int bits_per_pixel = job_bits_per_pixel(job);
+        return write_bmp(output_file, new_img, bits_per_pixel, bits_per_pixel == 4 || bits_per_pixel == 8);
     }
 
-    return new_image;
+    // Banded and tiled plans write straight into a file of the final size
+    BmpInfo out_info;
+    vector<int> out_palette;
+    int out_fd = create_job_bmp(output_file, job, in_info, out_info, out_palette);
+    int last = plan.strategy == PLAN_BANDED ? in_info.height : out_info.height;
+    bool ok = out_fd >= 0 && run_direct(job, plan.strategy, plan.band_rows, in_fd, in_info, in_palette,
+                                        out_fd, out_info, out_palette, 0, last);
+    return out_fd >= 0 && close(out_fd) == 0 && ok;
 }
 
 /**
- * Darkens image
- * @param image The input image to add effect to
- * @param scaling_factor The degree the image should be darkened
- * @return vector of vectors of type Pixel
+ * Runs one of the ten menu effects, serving it from the result cache when it has been run
+ * on the same pixels with the same parameters before
+ * @param input_file  The input BMP file name
+ * @param output_file The output BMP file name
+ * @param job         The job
+ * @param budget      Memory budget in bytes
+ * @param workers     Worker processes to split banded and tiled plans between, 1 for none
+ * @param cache       The result cache
+ * @return True if successful and false otherwise
  */
-vector<vector<Pixel>> process_9(vector<vector<Pixel>> image, double scaling_factor) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+bool run_job(string input_file, string output_file, const Job& job, long long budget, int workers,
+             const ResultCache& cache) {
+    // Enlarge only scales up
+    if (job.process == 6 && (job.x_scale <= 0 || job.y_scale <= 0))
+    {
+        return false;
+    }
 
-    for (int row = 0; row < num_rows; row++)
+    int in_fd = open(input_file.c_str(), O_RDONLY);
+    BmpInfo in_info;
+    vector<Pixel> in_palette;
+    if (in_fd < 0 || !read_bmp_info(in_fd, in_info, in_palette))
     {
-        for (int col = 0; col < num_columns; col++)
+        if (in_fd >= 0)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            int newred = red_color * scaling_factor;
-            int newgreen = green_color * scaling_factor;
-            int newblue = blue_color * scaling_factor;
-            
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].blue = newblue;
+            close(in_fd);
         }
+        return false;
     }
 
-    return new_image;
-}
+    string key;
+    if (!cache.dir.empty())
+    {
+        key = cache_key(in_fd, in_info, in_palette, job);
+    }
+    if (!key.empty() && cache_lookup(cache, key, output_file))
+    {
+        close(in_fd);
+        return true;
+    }
 
-/**
- * Converts to only black, white, red, blue and green
- * @param image The input image to add effect to
- * @return vector of vectors of type Pixel
- */
-vector<vector<Pixel>> process_10(vector<vector<Pixel>> image) {
-    int num_rows = image.size(); // height
-    int num_columns = image[0].size(); // width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
+    bool ok = run_planned(input_file, output_file, job, budget, workers, in_fd, in_info, in_palette);
+    close(in_fd);
+    if (ok && !key.empty())
+    {
+        cache_store(cache, key, output_file);
+    }
+    return ok;
+}
 
-    for (int row = 0; row < num_rows; row++)
+int main(int argc, char* argv[])
+{
+    // --mem-budget N caps the estimated peak memory of effects 1 - 10, e.g. --mem-budget 512M
+    // --workers N splits effects 1 - 10 between N worker processes
+    // --cache-dir DIR keeps the outputs of effects 1 - 10 in DIR and reuses them
+    // --cache-size N limits the size of the cache, 1G by default
+    // --keep-alpha saves effects 1 - 10 of 32 bit images as 32 bit BGRA, keeping their alpha channel
+    long long mem_budget = default_mem_budget();
+    int workers = 1;
+    ResultCache cache = {"", DEFAULT_CACHE_BYTES};
+    bool keep_alpha = false;
+    for (int i = 1; i < argc; i++)
     {
-        for (int col = 0; col < num_columns; col++)
+        string arg = argv[i];
+        string value;
+        if (arg == "--mem-budget" && i + 1 < argc)
         {
-            int red_color = image[row][col].red;
-            int green_color = image[row][col].green;
-            int blue_color = image[row][col].blue;
-
-            int newred = 0;
-            int newgreen = 0;
-            int newblue = 0;
-
-            int max_color = red_color;
-            if (green_color > red_color && green_color > blue_color)
-            {
-                max_color = green_color;
-            }
-            else if (blue_color > red_color && blue_color > green_color)
-            {
-                max_color = blue_color;
-            }
-
-            if (red_color + green_color + blue_color >= 550)
-            {
-                newred = 255;
-                newgreen = 255;
-                newblue = 255;
-            }
-            else if (red_color + green_color + blue_color <= 150)
-            {
-                newred = 0;
-                newgreen = 0;
-                newblue = 0;
-            }
-            else if (max_color == red_color)
-            {
-                newred = 255;
-                newgreen = 0;
-                newblue = 0;
-            }
-            else if (max_color == green_color)
-            {
-                newred = 0;
-                newgreen = 255;
-                newblue = 0;
-            }
-            else
-            {
-                newred = 0;
-                newgreen = 0;
-                newblue = 255;
-            }
-            
-            new_image[row][col].red = newred;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].blue = newblue;
+            value = argv[++i];
+            mem_budget = parse_size(value);
+        }
+        else if (arg.compare(0, 13, "--mem-budget=") == 0)
+        {
+            value = arg.substr(13);
+            mem_budget = parse_size(value);
+        }
+        else if (arg == "--workers" && i + 1 < argc)
+        {
+            value = argv[++i];
+            workers = atoi(value.c_str());
+        }
+        else if (arg.compare(0, 10, "--workers=") == 0)
+        {
+            value = arg.substr(10);
+            workers = atoi(value.c_str());
+        }
+        else if (arg == "--cache-dir" && i + 1 < argc)
+        {
+            value = argv[++i];
+            cache.dir = value;
+        }
+        else if (arg.compare(0, 12, "--cache-dir=") == 0)
+        {
+            value = arg.substr(12);
+            cache.dir = value;
+        }
+        else if (arg == "--keep-alpha")
+        {
+            keep_alpha = true;
+        }
+        else if (arg == "--cache-size" && i + 1 < argc)
+        {
+            value = argv[++i];
+            cache.max_bytes = parse_size(value);
+        }
+        else if (arg.compare(0, 13, "--cache-size=") == 0)
+        {
+            value = arg.substr(13);
+            cache.max_bytes = parse_size(value);
+        }
+        else
+        {
+            cout << "Unknown option: " << arg << endl;
+            return 1;
+        }
+        if (mem_budget <= 0)
+        {
+            cout << "Invalid memory budget: " << value << endl;
+            return 1;
+        }
+        if (workers <= 0)
+        {
+            cout << "Invalid number of workers: " << value << endl;
+            return 1;
+        }
+        if (cache.max_bytes <= 0)
+        {
+            cout << "Invalid cache size: " << value << endl;
+            return 1;
         }
     }
+    if (!cache.dir.empty() && mkdir(cache.dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        cout << "Cannot create cache directory: " << cache.dir << endl;
+        return 1;
+    }
 
-    return new_image;
-}
-
-int main()
-{
     cout << "CSPB 1300 Image Processing Application" << endl;
     cout << "Enter input BMP filename: ";
     string input_file;
@@ -710,6 +4457,13 @@ int main()
         cout << "8) Lighten" << endl;
         cout << "9) Darken" << endl;
         cout << "10) Black, white, red, green, blue" << endl;
+        cout << "11) Resize" << endl;
+        cout << "12) Blur" << endl;
+        cout << "13) Sharpen" << endl;
+        cout << "14) Edge detect" << endl;
+        cout << "15) Auto high contrast" << endl;
+        cout << "16) Auto clarendon" << endl;
+        cout << "17) Auto levels" << endl;
 
         cout << "Enter menu selection (Q to quit):";
         cin >> menu_item_selected;
@@ -730,11 +4484,12 @@ int main()
             string output_file_name;
             cin >> output_file_name;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_1 = process_1(img);
-            write_image(output_file_name, img_process_1);
-
-            cout << "Successfully applied vignette!" << endl;
+            Job job = {1, 0, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully applied vignette!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "2") {
             cout << "Clarendon selected" << endl;
 
@@ -746,11 +4501,12 @@ int main()
             double scaling_factor;
             cin >> scaling_factor;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_2 = process_2(img, scaling_factor);
-            write_image(output_file_name, img_process_2);
-
-            cout << "Successfully applied clarendon!" << endl;
+            Job job = {2, scaling_factor, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully applied clarendon!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "3") {
             cout << "Grayscale selected" << endl;
 
@@ -758,11 +4514,12 @@ int main()
             string output_file_name;
             cin >> output_file_name;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_3 = process_3(img);
-            write_image(output_file_name, img_process_3);
-
-            cout << "Successfully applied grayscale!" << endl;
+            Job job = {3, 0, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully applied grayscale!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "4") {
             cout << "Rotate 90 degrees selected" << endl;
 
@@ -770,11 +4527,12 @@ int main()
             string output_file_name;
             cin >> output_file_name;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_4 = process_4(img);
-            write_image(output_file_name, img_process_4);
-
-            cout << "Successfully applied 90 degree rotation!" << endl;
+            Job job = {4, 0, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully applied 90 degree rotation!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "5") {
             cout << "Rotate multiple 90 degrees selected" << endl;
 
@@ -786,11 +4544,12 @@ int main()
             int number_of_rotations;
             cin >> number_of_rotations;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_5 = process_5(img, number_of_rotations);
-            write_image(output_file_name, img_process_5);
-
-            cout << "Successfully applied multiple 90 degree rotations!" << endl;
+            Job job = {5, 0, number_of_rotations, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully applied multiple 90 degree rotations!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "6") {
             cout << "Enlarge selected" << endl;
 
@@ -806,11 +4565,17 @@ int main()
             int y_scale;
             cin >> y_scale;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_6 = process_6(img, x_scale, y_scale);
-            write_image(output_file_name, img_process_6);
+            if (x_scale <= 0 || y_scale <= 0) {
+                cout << "Invalid scale: X and Y scales must be positive" << endl;
+                continue;
+            }
 
-            cout << "Successfully enlarged!" << endl;
+            Job job = {6, 0, 0, x_scale, y_scale, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully enlarged!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "7") {
             cout << "High contrast selected" << endl;
 
@@ -818,11 +4583,12 @@ int main()
             string output_file_name;
             cin >> output_file_name;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_7 = process_7(img);
-            write_image(output_file_name, img_process_7);
-
-            cout << "Successfully applied high contrast!" << endl;
+            Job job = {7, 0, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully applied high contrast!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "8") {
             cout << "Lighten selected" << endl;
 
@@ -834,11 +4600,12 @@ int main()
             double scaling_factor;
             cin >> scaling_factor;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_8 = process_8(img, scaling_factor);
-            write_image(output_file_name, img_process_8);
-
-            cout << "Successfully lightened!" << endl;
+            Job job = {8, scaling_factor, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully lightened!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "9") {
             cout << "Darken selected" << endl;
 
@@ -850,11 +4617,12 @@ int main()
             double scaling_factor;
             cin >> scaling_factor;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_9 = process_9(img, scaling_factor);
-            write_image(output_file_name, img_process_9);
-
-            cout << "Successfully darkened!" << endl;
+            Job job = {9, scaling_factor, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully darkened!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else if (menu_item_selected == "10") {
             cout << "Black, white, red, green, blue selected" << endl;
 
@@ -862,11 +4630,176 @@ int main()
             string output_file_name;
             cin >> output_file_name;
 
-            vector<vector<Pixel>> img = read_image(input_file);
-            vector<vector<Pixel>> img_process_10 = process_10(img);
-            write_image(output_file_name, img_process_10);
+            Job job = {10, 0, 0, 1, 1, keep_alpha};
+            if (run_job(input_file, output_file_name, job, mem_budget, workers, cache)) {
+                cout << "Successfully applied black, white, red, green, blue filter!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
+        } else if (menu_item_selected == "11") {
+            cout << "Resize selected" << endl;
+
+            cout << "Enter output BMP filename: ";
+            string output_file_name;
+            cin >> output_file_name;
+
+            cout << "Enter X scale: ";
+            double x_scale;
+            cin >> x_scale;
+
+            cout << "Enter Y scale: ";
+            double y_scale;
+            cin >> y_scale;
+
+            cout << "Enter filter (0 = nearest, 1 = bilinear, 2 = box): ";
+            int filter;
+            cin >> filter;
+
+            vector<vector<Pixel>> img = read_bmp(input_file);
+            if (img.empty()) {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+                continue;
+            }
+            int new_width = max(1, (int)round(img[0].size() * x_scale));
+            int new_height = max(1, (int)round(img.size() * y_scale));
+            if (resample_to_file(output_file_name, img, new_width, new_height, filter)) {
+                cout << "Successfully resized!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
+        } else if (menu_item_selected == "12") {
+            cout << "Blur selected" << endl;
+
+            cout << "Enter output BMP filename: ";
+            string output_file_name;
+            cin >> output_file_name;
+
+            cout << "Enter blur radius: ";
+            int radius;
+            cin >> radius;
+
+            cout << "Enter kernel (0 = box, 1 = Gaussian): ";
+            int kernel;
+            cin >> kernel;
+
+            vector<vector<Pixel>> img = read_bmp(input_file);
+            if (img.empty()) {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+                continue;
+            }
+            vector<vector<Pixel>> img_blur = process_blur(img, radius, kernel);
+            if (write_bmp(output_file_name, img_blur, 24, false)) {
+                cout << "Successfully blurred!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
+        } else if (menu_item_selected == "13") {
+            cout << "Sharpen selected" << endl;
+
+            cout << "Enter output BMP filename: ";
+            string output_file_name;
+            cin >> output_file_name;
+
+            cout << "Enter blur radius: ";
+            int radius;
+            cin >> radius;
+
+            cout << "Enter amount: ";
+            double amount;
+            cin >> amount;
+
+            vector<vector<Pixel>> img = read_bmp(input_file);
+            if (img.empty()) {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+                continue;
+            }
+            vector<vector<Pixel>> img_sharpen = process_sharpen(img, radius, amount);
+            if (write_bmp(output_file_name, img_sharpen, 24, false)) {
+                cout << "Successfully sharpened!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
+        } else if (menu_item_selected == "14") {
+            cout << "Edge detect selected" << endl;
+
+            cout << "Enter output BMP filename: ";
+            string output_file_name;
+            cin >> output_file_name;
+
+            vector<vector<Pixel>> img = read_bmp(input_file);
+            if (img.empty()) {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+                continue;
+            }
+            vector<vector<Pixel>> img_edges = process_edges(img);
+            if (write_bmp(output_file_name, img_edges, 8, true)) {
+                cout << "Successfully detected edges!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
+        } else if (menu_item_selected == "15") {
+            cout << "Auto high contrast selected" << endl;
+
+            cout << "Enter output BMP filename: ";
+            string output_file_name;
+            cin >> output_file_name;
+
+            ImageStats stats;
+            vector<vector<Pixel>> img = read_bmp(input_file, &stats);
+            if (img.empty()) {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+                continue;
+            }
+            cout << "Otsu threshold: " << otsu_threshold(stats) << endl;
+            vector<vector<Pixel>> img_process_7 = process_7_auto(img, stats);
+            if (write_bmp(output_file_name, img_process_7, 1, false)) {
+                cout << "Successfully applied auto high contrast!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
+        } else if (menu_item_selected == "16") {
+            cout << "Auto clarendon selected" << endl;
+
+            cout << "Enter output BMP filename: ";
+            string output_file_name;
+            cin >> output_file_name;
+
+            cout << "Enter scaling factor: ";
+            double scaling_factor;
+            cin >> scaling_factor;
+
+            ImageStats stats;
+            vector<vector<Pixel>> img = read_bmp(input_file, &stats);
+            if (img.empty()) {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+                continue;
+            }
+            cout << "Mean brightness: " << stats_mean(stats, STATS_GRAY) << endl;
+            vector<vector<Pixel>> img_process_2 = process_2_auto(img, scaling_factor, stats);
+            if (write_bmp(output_file_name, img_process_2, 24, false)) {
+                cout << "Successfully applied auto clarendon!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
+        } else if (menu_item_selected == "17") {
+            cout << "Auto levels selected" << endl;
+
+            cout << "Enter output BMP filename: ";
+            string output_file_name;
+            cin >> output_file_name;
 
-            cout << "Successfully applied black, white, red, green, blue filter!" << endl;
+            ImageStats stats;
+            vector<vector<Pixel>> img = read_bmp(input_file, &stats);
+            if (img.empty()) {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+                continue;
+            }
+            vector<vector<Pixel>> img_levels = process_auto_levels(img, stats);
+            if (write_bmp(output_file_name, img_levels, 24, false)) {
+                cout << "Successfully applied auto levels!" << endl;
+            } else {
+                cout << "Could not process " << input_file << " into " << output_file_name << endl;
+            }
         } else {
             cout << "Input selected is not valid. Please select a valid option." << endl;
         }